@@ -6,20 +6,425 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <ngx_sha1.h>
+#include <sys/file.h>
+
+/* Slots probed per lookup before the least recently used one is evicted */
+#define NGX_HTTP_BLOCK_LEGACY_PROBES    8
+
+/* How long a client stays classified as legacy after its last request */
+#define NGX_HTTP_BLOCK_LEGACY_TTL       60000
+
+/* How often a worker checks whether it has started a graceful shutdown */
+#define NGX_HTTP_BLOCK_LEGACY_EXIT_POLL 500
+
+/* Idle legacy connections closed per accept when connections run low */
+#define NGX_HTTP_BLOCK_LEGACY_RECLAIM   32
+
+/*
+ * Reclaiming starts below 1/8 of worker_connections free, ahead of the
+ * core drain of reusable connections at 1/16
+ */
+#define NGX_HTTP_BLOCK_LEGACY_RECLAIM_SHARE  8
+
+/* Synthetic probe defaults */
+#define NGX_HTTP_BLOCK_LEGACY_PROBE_INTERVAL  10000
+#define NGX_HTTP_BLOCK_LEGACY_PROBE_TIMEOUT   5000
+
+/* Local addresses of running probes, one per worker (modulo) */
+#define NGX_HTTP_BLOCK_LEGACY_PROBE_PEERS     64
+
+/* Latency histogram buckets, powers of two microseconds */
+#define NGX_HTTP_BLOCK_LEGACY_BUCKETS   16
+
+/* Connections accepted in one event loop pass checked together */
+#define NGX_HTTP_BLOCK_LEGACY_BATCH     64
+
+#if (__GNUC__ || __clang__)
+#define ngx_http_block_legacy_prefetch(p)  __builtin_prefetch(p)
+#else
+#define ngx_http_block_legacy_prefetch(p)
+#endif
+
+/* Cookie challenge: lifetime in seconds and per worker cache entries */
+#define NGX_HTTP_BLOCK_LEGACY_COOKIE    "block_legacy"
+#define NGX_HTTP_BLOCK_LEGACY_COOKIE_TTL  3600
+#define NGX_HTTP_BLOCK_LEGACY_TOKENS    256
+
+/* Header of the cold spill file, "BLSP" */
+#define NGX_HTTP_BLOCK_LEGACY_SPILL_MAGIC  0x50534c42
+
+/* Nonzero tag of a client in the cold table presence filter */
+#define ngx_http_block_legacy_tag(hash)                                     \
+    ((u_char) ((hash) >> 24) ? (u_char) ((hash) >> 24) : 1)
+
+/* Per worker cache that samples updates of h2-capable clients */
+#define NGX_HTTP_BLOCK_LEGACY_SEEN      1024
+
+/*
+ * Per worker cache of h2-capable lookups; a miss is trusted for a second,
+ * since another worker may record the client's HTTP/2 request meanwhile
+ */
+#define NGX_HTTP_BLOCK_LEGACY_CAPABLE   1024
+#define NGX_HTTP_BLOCK_LEGACY_CAPABLE_MISS  1000
+
+#define NGX_HTTP_BLOCK_LEGACY_LEGACY    0x01
+#define NGX_HTTP_BLOCK_LEGACY_MODERN    0x02
+
+/* Rule actions */
+#define NGX_HTTP_BLOCK_LEGACY_NONE      0
+#define NGX_HTTP_BLOCK_LEGACY_ALLOW     1
+#define NGX_HTTP_BLOCK_LEGACY_BLOCK     2
+#define NGX_HTTP_BLOCK_LEGACY_CHALLENGE 3
+
+/* Rule bytecode, every predicate leaves its result in the accumulator */
+#define NGX_HTTP_BLOCK_LEGACY_OP_END        0
+#define NGX_HTTP_BLOCK_LEGACY_OP_JF         1   /* jump if false */
+#define NGX_HTTP_BLOCK_LEGACY_OP_JT         2   /* jump if true */
+#define NGX_HTTP_BLOCK_LEGACY_OP_NOT        3
+#define NGX_HTTP_BLOCK_LEGACY_OP_VERSION    4
+#define NGX_HTTP_BLOCK_LEGACY_OP_METHOD     5
+#define NGX_HTTP_BLOCK_LEGACY_OP_HEADER     6
+#define NGX_HTTP_BLOCK_LEGACY_OP_NET        7
+#define NGX_HTTP_BLOCK_LEGACY_OP_TIME       8
+#define NGX_HTTP_BLOCK_LEGACY_OP_WEBSOCKET  9
+
+#define NGX_HTTP_BLOCK_LEGACY_NO_JUMP   0xffff
+
+/* Bits of the per-location version mask */
+#define NGX_HTTP_BLOCK_LEGACY_V09       0
+#define NGX_HTTP_BLOCK_LEGACY_V10       1
+#define NGX_HTTP_BLOCK_LEGACY_V11       2
+#define NGX_HTTP_BLOCK_LEGACY_VMODERN   3   /* never set */
+
+#define ngx_http_block_legacy_version(v)                                      \
+    ((v) == NGX_HTTP_VERSION_11 ? NGX_HTTP_BLOCK_LEGACY_V11                   \
+     : (v) == NGX_HTTP_VERSION_10 ? NGX_HTTP_BLOCK_LEGACY_V10                 \
+     : (v) == NGX_HTTP_VERSION_9 ? NGX_HTTP_BLOCK_LEGACY_V09                  \
+     : NGX_HTTP_BLOCK_LEGACY_VMODERN)
+
+typedef struct {
+    u_char      addr[16];           /* IPv4 is stored IPv4-mapped */
+    uint32_t    hash;               /* 0 marks an empty slot */
+    uint32_t    flags;
+    ngx_msec_t  access;
+    ngx_msec_t  legacy;             /* last allowed legacy request */
+    ngx_msec_t  modern;             /* last recorded HTTP/2+ request */
+    ngx_msec_t  conn_last;
+    ngx_int_t   conn_excess;
+    uint32_t    fingerprint;
+} ngx_http_block_legacy_slot_t;
+
+typedef struct {
+    u_char                        addr[16];
+    ngx_atomic_t                  port;     /* 0 if no probe is running */
+} ngx_http_block_legacy_probe_peer_t;
+
+typedef struct {
+    ngx_atomic_t                  conn_rejected;
+    ngx_atomic_t                  handshakes_avoided;
+    ngx_atomic_t                  shutdown_closed;
+    ngx_atomic_t                  reclaimed;
+    ngx_atomic_t                  probe_ok;
+    ngx_atomic_t                  probe_failed;
+    ngx_atomic_t                  probe_latency[NGX_HTTP_BLOCK_LEGACY_BUCKETS];
+    ngx_http_block_legacy_probe_peer_t
+                              probe_peers[NGX_HTTP_BLOCK_LEGACY_PROBE_PEERS];
+    ngx_atomic_t                  demoted;
+    ngx_atomic_t                  promoted;
+    ngx_uint_t                    nslots;
+    ngx_http_block_legacy_slot_t *slots;
+
+    /* tag of each cold slot, 0 if empty, so misses need not read the file */
+    u_char                       *spill_tags;
+} ngx_http_block_legacy_shctx_t;
+
+/*
+ * The slots follow the header, in the same format as in the zone.  The
+ * magic is checked before an existing file is truncated.
+ */
+
+typedef struct {
+    uint32_t                      magic;
+    uint32_t                      reserved; /* keeps the slots aligned */
+} ngx_http_block_legacy_spill_t;
+
+/*
+ * A spill mapping, shared by the configurations that use it; the file
+ * stays locked as long as the master or any worker has it open.
+ */
+
+typedef struct {
+    ngx_http_block_legacy_spill_t *spill;
+    size_t                         size;
+    ngx_fd_t                       fd;
+    ngx_uint_t                     refs;
+} ngx_http_block_legacy_spill_map_t;
+
+typedef struct {
+    ngx_http_block_legacy_shctx_t *sh;
+    ngx_slab_pool_t               *shpool;
+
+    /* cold table mapped from a file, shared by all workers */
+    ngx_str_t                      spill_path;
+    size_t                         spill_size;
+    ngx_uint_t                     spill_nslots;
+    ngx_http_block_legacy_spill_map_t *spill;
+    ngx_http_block_legacy_slot_t  *spill_slots;
+} ngx_http_block_legacy_ctx_t;
+
+typedef struct {
+    ngx_addr_t             *addr;
+    ngx_str_t               request;
+    ngx_msec_t              interval;
+
+    /* per worker probe state */
+    ngx_event_t             event;
+    ngx_peer_connection_t   peer;
+    uint64_t                start;
+    u_char                 *sent;
+    size_t                  len;
+    u_char                  buf[sizeof("HTTP/1.x 426") - 1];
+} ngx_http_block_legacy_probe_t;
+
+typedef struct {
+    u_char      mac[20];
+    u_char      addr[16];
+    time_t      expires;            /* 0 marks an empty entry */
+} ngx_http_block_legacy_token_t;
+
+typedef struct {
+    uint32_t    hash;
+    uint32_t    fingerprint;
+    ngx_msec_t  written;
+} ngx_http_block_legacy_seen_t;
+
+typedef struct {
+    uint32_t    hash;
+    uint32_t    fingerprint;
+    ngx_msec_t  expires;
+    ngx_uint_t  capable;
+} ngx_http_block_legacy_capable_t;
+
+/* whether a connection's client is in any trace network, per worker */
+
+typedef struct {
+    ngx_atomic_uint_t  number;      /* connection the entry is for */
+    ngx_uint_t         match;
+} ngx_http_block_legacy_traced_t;
+
+typedef struct {
+    ngx_shm_zone_t *shm_zone;
+    ngx_uint_t      conn_rate;      /* connections per 1000 s */
+    ngx_uint_t      conn_burst;     /* scaled by 1000 */
+    ngx_flag_t      accept_batch;
+
+    /* per worker batch of connections accepted in one pass */
+    ngx_connection_t *batch[NGX_HTTP_BLOCK_LEGACY_BATCH];
+    ngx_uint_t      nbatch;
+    ngx_event_t     batch_event;
+
+    ngx_msec_t      shutdown_close; /* grace, NGX_CONF_UNSET_MSEC if off */
+    ngx_flag_t      reclaim;
+
+    /* per worker registry of legacy keepalive connections */
+    ngx_uint_t      registry;
+    ngx_queue_t     connections;    /* with a request in progress */
+    ngx_queue_t     idle;           /* between requests, LRU first */
+    time_t          reclaim_time;   /* last "not enough" warning */
+    ngx_event_t     exit_event;
+    ngx_uint_t      exiting;
+
+    ngx_http_block_legacy_probe_t *probe;
+
+    /* stateless cookie challenge */
+    ngx_uint_t      challenge;      /* used in some location */
+    ngx_str_t       challenge_secret;
+    ngx_sha1_t      challenge_inner; /* HMAC key pads absorbed */
+    ngx_sha1_t      challenge_outer;
+    ngx_http_block_legacy_token_t *tokens; /* per worker verified cookies */
+
+    /* clients recently seen speaking HTTP/2 or HTTP/3 */
+    ngx_msec_t      h2_memory;      /* 0 if off */
+    ngx_http_complex_value_t *h2_fingerprint;
+    ngx_http_block_legacy_seen_t *seen;
+    ngx_http_block_legacy_capable_t *capable;
+
+    /* trace networks of all locations, matched once per connection */
+    ngx_array_t    *trace;          /* of ngx_cidr_t */
+    ngx_http_block_legacy_traced_t *traced;
+} ngx_http_block_legacy_main_conf_t;
+
+typedef struct {
+    ngx_queue_t         queue;
+    ngx_connection_t   *connection;
+    ngx_http_request_t *request;    /* main request in progress, if any */
+} ngx_http_block_legacy_conn_t;
+
+typedef struct {
+    uint16_t    op;
+    uint16_t    jump;
+    uint32_t    arg;
+} ngx_http_block_legacy_op_t;
+
+typedef struct {
+    ngx_uint_t                  action;
+    ngx_str_t                   text;
+    ngx_http_block_legacy_op_t *code;
+    ngx_array_t                 nets;       /* of ngx_cidr_t */
+    ngx_array_t                 headers;    /* of ngx_str_t */
+} ngx_http_block_legacy_rule_t;
 
 typedef struct {
+    ngx_conf_t                   *cf;
+    ngx_str_t                    *tokens;
+    ngx_uint_t                    ntokens;
+    ngx_uint_t                    pos;
+    ngx_array_t                  *code;     /* of ngx_http_block_legacy_op_t */
+    ngx_http_block_legacy_rule_t *rule;
+} ngx_http_block_legacy_compiler_t;
+
+typedef struct ngx_http_block_legacy_conf_s  ngx_http_block_legacy_conf_t;
+
+typedef ngx_int_t (*ngx_http_block_legacy_evaluate_pt)(ngx_http_request_t *r,
+    ngx_http_block_legacy_conf_t *conf);
+
+struct ngx_http_block_legacy_conf_s {
     ngx_flag_t  enable;
     ngx_flag_t  block_http10;
     ngx_flag_t  block_http11;
     ngx_flag_t  block_http09;
     ngx_str_t   custom_message;
-} ngx_http_block_legacy_conf_t;
+    ngx_array_t *trace;             /* of ngx_cidr_t */
+    ngx_flag_t  trace_all;
+    ngx_flag_t  allow_websocket;
+    ngx_array_t *rules;             /* of ngx_http_block_legacy_rule_t */
+    ngx_flag_t  challenge;
+    ngx_flag_t  h2_fallback;
+
+    /* set at merge time */
+    ngx_uint_t  tracing;            /* trace networks or "all" */
+    ngx_uint_t  versions;           /* mask of NGX_HTTP_BLOCK_LEGACY_V* bits */
+    ngx_uint_t  hooks;              /* allowed requests update client state */
+    ngx_http_block_legacy_evaluate_pt  evaluate;
+};
 
 static ngx_int_t ngx_http_block_legacy_handler(ngx_http_request_t *r);
+static ngx_uint_t ngx_http_block_legacy_traced(ngx_http_request_t *r);
+static ngx_int_t ngx_http_block_legacy_never(ngx_http_request_t *r,
+    ngx_http_block_legacy_conf_t *conf);
+static ngx_int_t ngx_http_block_legacy_mask(ngx_http_request_t *r,
+    ngx_http_block_legacy_conf_t *conf);
+static ngx_int_t ngx_http_block_legacy_mask_exempt(ngx_http_request_t *r,
+    ngx_http_block_legacy_conf_t *conf);
+static ngx_int_t ngx_http_block_legacy_general(ngx_http_request_t *r,
+    ngx_http_block_legacy_conf_t *conf);
+static ngx_int_t ngx_http_block_legacy_allowed(ngx_http_request_t *r,
+    ngx_uint_t trace);
+static ngx_int_t ngx_http_block_legacy_respond(ngx_http_request_t *r,
+    ngx_http_block_legacy_conf_t *conf, ngx_str_t *blocked_version);
+static void *ngx_http_block_legacy_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_block_legacy_init_main_conf(ngx_conf_t *cf, void *conf);
 static void *ngx_http_block_legacy_create_conf(ngx_conf_t *cf);
 static char *ngx_http_block_legacy_merge_conf(ngx_conf_t *cf, void *parent, void *child);
+static ngx_int_t ngx_http_block_legacy_add_variables(ngx_conf_t *cf);
 static ngx_int_t ngx_http_block_legacy_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_block_legacy_init_module(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_block_legacy_init_process(ngx_cycle_t *cycle);
 static char *ngx_http_block_legacy_custom_message(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_block_legacy_trace_cidr(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static void ngx_http_block_legacy_trace(ngx_http_request_t *r, const char *fmt, ...);
+static char *ngx_http_block_legacy_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_block_legacy_conn_rate(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_block_legacy_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static uint32_t ngx_http_block_legacy_key(struct sockaddr *sa, u_char *key);
+static ngx_uint_t ngx_http_block_legacy_is_probe(
+    ngx_http_block_legacy_main_conf_t *bmcf, struct sockaddr *sa);
+static ngx_http_block_legacy_slot_t *ngx_http_block_legacy_lookup(
+    ngx_http_block_legacy_ctx_t *ctx, u_char *key, uint32_t hash,
+    ngx_uint_t create);
+static ngx_http_block_legacy_slot_t *ngx_http_block_legacy_find(
+    ngx_http_block_legacy_slot_t *slots, ngx_uint_t nslots, u_char *key,
+    uint32_t hash, ngx_http_block_legacy_slot_t **victim);
+static void ngx_http_block_legacy_demote(ngx_http_block_legacy_ctx_t *ctx,
+    ngx_http_block_legacy_slot_t *slot);
+static void ngx_http_block_legacy_spill_cleanup(void *data);
+static void ngx_http_block_legacy_spill_populate(
+    ngx_http_block_legacy_spill_map_t *map);
+static ngx_uint_t ngx_http_block_legacy_spill_maybe(
+    ngx_http_block_legacy_ctx_t *ctx, uint32_t hash);
+static ngx_int_t ngx_http_block_legacy_init_spill(ngx_shm_zone_t *shm_zone,
+    ngx_http_block_legacy_ctx_t *ctx, ngx_http_block_legacy_ctx_t *octx);
+static void ngx_http_block_legacy_classify(ngx_http_request_t *r, ngx_uint_t trace);
+static void ngx_http_block_legacy_init_connection(ngx_connection_t *c);
+static void ngx_http_block_legacy_batch_handler(ngx_event_t *ev);
+static void ngx_http_block_legacy_conn_limit(ngx_connection_t **cs,
+    ngx_uint_t n, ngx_http_block_legacy_main_conf_t *bmcf);
+static void ngx_http_block_legacy_prefetch_window(
+    ngx_http_block_legacy_shctx_t *sh, ngx_uint_t k);
+static ngx_int_t ngx_http_block_legacy_conn_check(
+    ngx_http_block_legacy_ctx_t *ctx, ngx_http_block_legacy_main_conf_t *bmcf,
+    u_char *key, uint32_t hash);
+static ngx_uint_t ngx_http_block_legacy_listening_ssl(ngx_listening_t *ls);
+static char *ngx_http_block_legacy_shutdown_close(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static void ngx_http_block_legacy_track(ngx_http_request_t *r);
+static ngx_int_t ngx_http_block_legacy_post_read(ngx_http_request_t *r);
+static ngx_http_block_legacy_conn_t *ngx_http_block_legacy_registered(
+    ngx_connection_t *c);
+static void ngx_http_block_legacy_busy(
+    ngx_http_block_legacy_main_conf_t *bmcf, ngx_http_block_legacy_conn_t *lc,
+    ngx_http_request_t *r);
+static void ngx_http_block_legacy_conn_cleanup(void *data);
+static void ngx_http_block_legacy_request_cleanup(void *data);
+static void ngx_http_block_legacy_exit_handler(ngx_event_t *ev);
+static void ngx_http_block_legacy_close_idle(ngx_http_block_legacy_main_conf_t *bmcf);
+static void ngx_http_block_legacy_reclaim(ngx_http_block_legacy_main_conf_t *bmcf);
+static char *ngx_http_block_legacy_probe(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static void ngx_http_block_legacy_probe_start(ngx_event_t *ev);
+static ngx_int_t ngx_http_block_legacy_probe_connect(
+    ngx_peer_connection_t *pc);
+static ngx_int_t ngx_http_block_legacy_probe_source(
+    ngx_peer_connection_t *pc, ngx_sockaddr_t *sa, socklen_t *len);
+static void ngx_http_block_legacy_probe_write(ngx_event_t *wev);
+static void ngx_http_block_legacy_probe_read(ngx_event_t *rev);
+static void ngx_http_block_legacy_probe_done(ngx_http_block_legacy_probe_t *probe,
+    ngx_uint_t ok);
+static void ngx_http_block_legacy_probe_peer(ngx_connection_t *c,
+    ngx_uint_t running);
+static ngx_int_t ngx_http_block_legacy_histogram_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_uint_t ngx_http_block_legacy_websocket(ngx_http_request_t *r);
+static char *ngx_http_block_legacy_rule(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_block_legacy_compile_or(ngx_http_block_legacy_compiler_t *cc);
+static ngx_int_t ngx_http_block_legacy_compile_and(ngx_http_block_legacy_compiler_t *cc);
+static ngx_int_t ngx_http_block_legacy_compile_unary(ngx_http_block_legacy_compiler_t *cc);
+static ngx_int_t ngx_http_block_legacy_compile_predicate(
+    ngx_http_block_legacy_compiler_t *cc, ngx_str_t *tok);
+static ngx_int_t ngx_http_block_legacy_emit(ngx_http_block_legacy_compiler_t *cc,
+    ngx_uint_t op, ngx_uint_t jump, ngx_uint_t arg);
+static void ngx_http_block_legacy_patch(ngx_http_block_legacy_compiler_t *cc,
+    ngx_uint_t chain);
+static ngx_uint_t ngx_http_block_legacy_rules(ngx_http_request_t *r,
+    ngx_array_t *rules, ngx_uint_t trace);
+static ngx_uint_t ngx_http_block_legacy_run(ngx_http_request_t *r,
+    ngx_http_block_legacy_rule_t *rule);
+static ngx_uint_t ngx_http_block_legacy_has_header(ngx_http_request_t *r,
+    ngx_str_t *name);
+static ngx_int_t ngx_http_block_legacy_counter_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static char *ngx_http_block_legacy_challenge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_block_legacy_challenge_key(ngx_conf_t *cf,
+    ngx_http_block_legacy_main_conf_t *bmcf);
+static void ngx_http_block_legacy_sign(ngx_http_block_legacy_main_conf_t *bmcf,
+    time_t expires, u_char *addr, u_char *mac);
+static ngx_int_t ngx_http_block_legacy_verify(ngx_http_request_t *r,
+    ngx_uint_t trace);
+static ngx_int_t ngx_http_block_legacy_send_challenge(ngx_http_request_t *r);
+static char *ngx_http_block_legacy_h2_memory(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static uint32_t ngx_http_block_legacy_fingerprint(ngx_http_request_t *r,
+    ngx_http_block_legacy_main_conf_t *bmcf);
+static void ngx_http_block_legacy_remember(ngx_http_request_t *r);
+static ngx_uint_t ngx_http_block_legacy_h2_capable(ngx_http_request_t *r);
 
 static ngx_command_t ngx_http_block_legacy_commands[] = {
     {
@@ -54,6 +459,110 @@ static ngx_command_t ngx_http_block_legacy_commands[] = {
         offsetof(ngx_http_block_legacy_conf_t, block_http09),
         NULL
     },
+    {
+        ngx_string("block_legacy_allow_websocket"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_block_legacy_conf_t, allow_websocket),
+        NULL
+    },
+    {
+        ngx_string("block_legacy_rule"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_2MORE,
+        ngx_http_block_legacy_rule,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("block_legacy_challenge"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+        ngx_http_block_legacy_challenge,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_block_legacy_conf_t, challenge),
+        NULL
+    },
+    {
+        ngx_string("block_legacy_h2_fallback"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_block_legacy_conf_t, h2_fallback),
+        NULL
+    },
+    {
+        ngx_string("block_legacy_trace"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+        ngx_http_block_legacy_trace_cidr,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_block_legacy_conf_t, trace),
+        NULL
+    },
+    {
+        ngx_string("block_legacy_challenge_secret"),
+        NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+        ngx_conf_set_str_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_block_legacy_main_conf_t, challenge_secret),
+        NULL
+    },
+    {
+        ngx_string("block_legacy_h2_memory"),
+        NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+        ngx_http_block_legacy_h2_memory,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("block_legacy_zone"),
+        NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+        ngx_http_block_legacy_zone,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("block_legacy_conn_rate"),
+        NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+        ngx_http_block_legacy_conn_rate,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("block_legacy_accept_batch"),
+        NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_block_legacy_main_conf_t, accept_batch),
+        NULL
+    },
+    {
+        ngx_string("block_legacy_shutdown_close"),
+        NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+        ngx_http_block_legacy_shutdown_close,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("block_legacy_reclaim"),
+        NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_block_legacy_main_conf_t, reclaim),
+        NULL
+    },
+    {
+        ngx_string("block_legacy_probe"),
+        NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE23,
+        ngx_http_block_legacy_probe,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        0,
+        NULL
+    },
     {
         ngx_string("legacy_http_message"),
         NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
@@ -65,11 +574,93 @@ static ngx_command_t ngx_http_block_legacy_commands[] = {
     ngx_null_command
 };
 
+static ngx_http_variable_t ngx_http_block_legacy_vars[] = {
+    {
+        ngx_string("block_legacy_conn_rejected"),
+        NULL,
+        ngx_http_block_legacy_counter_variable,
+        offsetof(ngx_http_block_legacy_shctx_t, conn_rejected),
+        NGX_HTTP_VAR_NOCACHEABLE,
+        0
+    },
+    {
+        ngx_string("block_legacy_handshakes_avoided"),
+        NULL,
+        ngx_http_block_legacy_counter_variable,
+        offsetof(ngx_http_block_legacy_shctx_t, handshakes_avoided),
+        NGX_HTTP_VAR_NOCACHEABLE,
+        0
+    },
+    {
+        ngx_string("block_legacy_shutdown_closed"),
+        NULL,
+        ngx_http_block_legacy_counter_variable,
+        offsetof(ngx_http_block_legacy_shctx_t, shutdown_closed),
+        NGX_HTTP_VAR_NOCACHEABLE,
+        0
+    },
+    {
+        ngx_string("block_legacy_reclaimed"),
+        NULL,
+        ngx_http_block_legacy_counter_variable,
+        offsetof(ngx_http_block_legacy_shctx_t, reclaimed),
+        NGX_HTTP_VAR_NOCACHEABLE,
+        0
+    },
+    {
+        ngx_string("block_legacy_probe_ok"),
+        NULL,
+        ngx_http_block_legacy_counter_variable,
+        offsetof(ngx_http_block_legacy_shctx_t, probe_ok),
+        NGX_HTTP_VAR_NOCACHEABLE,
+        0
+    },
+    {
+        ngx_string("block_legacy_probe_failed"),
+        NULL,
+        ngx_http_block_legacy_counter_variable,
+        offsetof(ngx_http_block_legacy_shctx_t, probe_failed),
+        NGX_HTTP_VAR_NOCACHEABLE,
+        0
+    },
+    {
+        ngx_string("block_legacy_demoted"),
+        NULL,
+        ngx_http_block_legacy_counter_variable,
+        offsetof(ngx_http_block_legacy_shctx_t, demoted),
+        NGX_HTTP_VAR_NOCACHEABLE,
+        0
+    },
+    {
+        ngx_string("block_legacy_promoted"),
+        NULL,
+        ngx_http_block_legacy_counter_variable,
+        offsetof(ngx_http_block_legacy_shctx_t, promoted),
+        NGX_HTTP_VAR_NOCACHEABLE,
+        0
+    },
+    {
+        ngx_string("block_legacy_probe_latency"),
+        NULL,
+        ngx_http_block_legacy_histogram_variable,
+        offsetof(ngx_http_block_legacy_shctx_t, probe_latency),
+        NGX_HTTP_VAR_NOCACHEABLE,
+        0
+    },
+    ngx_http_null_variable
+};
+
+static ngx_str_t ngx_http_block_legacy_versions[] = {
+    ngx_string("HTTP/0.9"),
+    ngx_string("HTTP/1.0"),
+    ngx_string("HTTP/1.1")
+};
+
 static ngx_http_module_t ngx_http_block_legacy_module_ctx = {
-    NULL,                                    /* preconfiguration */
+    ngx_http_block_legacy_add_variables,    /* preconfiguration */
     ngx_http_block_legacy_init,             /* postconfiguration */
-    NULL,                                    /* create main configuration */
-    NULL,                                    /* init main configuration */
+    ngx_http_block_legacy_create_main_conf, /* create main configuration */
+    ngx_http_block_legacy_init_main_conf,   /* init main configuration */
     NULL,                                    /* create server configuration */
     NULL,                                    /* merge server configuration */
     ngx_http_block_legacy_create_conf,      /* create location configuration */
@@ -82,8 +673,8 @@ ngx_module_t ngx_http_block_legacy_module = {
     ngx_http_block_legacy_commands,         /* module directives */
     NGX_HTTP_MODULE,                        /* module type */
     NULL,                                    /* init master */
-    NULL,                                    /* init module */
-    NULL,                                    /* init process */
+    ngx_http_block_legacy_init_module,      /* init module */
+    ngx_http_block_legacy_init_process,     /* init process */
     NULL,                                    /* init thread */
     NULL,                                    /* exit thread */
     NULL,                                    /* exit process */
@@ -95,134 +686,506 @@ static ngx_int_t
 ngx_http_block_legacy_handler(ngx_http_request_t *r)
 {
     ngx_http_block_legacy_conf_t *conf;
-    ngx_int_t should_block = 0;
-    ngx_str_t blocked_version = ngx_null_string;
-    ngx_str_t response_body;
-    ngx_buf_t *b;
-    ngx_chain_t out;
 
     conf = ngx_http_get_module_loc_conf(r, ngx_http_block_legacy_module);
 
-    /* Check if module is enabled */
-    if (!conf->enable) {
-        return NGX_DECLINED;
-    }
-
-    /* Check which HTTP version to block */
-    switch (r->http_version) {
-        case NGX_HTTP_VERSION_9:
-            if (conf->block_http09) {
-                should_block = 1;
-                ngx_str_set(&blocked_version, "HTTP/0.9");
-            }
-            break;
+    /* traced clients take the general path, which logs every step */
 
-        case NGX_HTTP_VERSION_10:
-            if (conf->block_http10) {
-                should_block = 1;
-                ngx_str_set(&blocked_version, "HTTP/1.0");
-            }
-            break;
+    if (conf->tracing
+        && (conf->trace_all || ngx_http_block_legacy_traced(r)))
+    {
+        return ngx_http_block_legacy_general(r, conf);
+    }
 
-        case NGX_HTTP_VERSION_11:
-            if (conf->block_http11) {
-                should_block = 1;
-                ngx_str_set(&blocked_version, "HTTP/1.1");
-            }
-            break;
+    return conf->evaluate(r, conf);
+}
 
-        default:
-            /* HTTP/2.0+ are allowed */
-            return NGX_DECLINED;
-    }
+/*
+ * Matches the client against the trace networks of all locations once
+ * per connection; the location's own networks are only checked for
+ * clients that match, in ngx_http_block_legacy_general().
+ */
 
-    if (!should_block) {
-        return NGX_DECLINED;
-    }
+static ngx_uint_t
+ngx_http_block_legacy_traced(ngx_http_request_t *r)
+{
+    ngx_connection_t *c;
+    ngx_http_block_legacy_traced_t *t;
+    ngx_http_block_legacy_main_conf_t *bmcf;
 
-    /* Log blocked request */
-    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
-                 "%V request blocked by security policy, "
-                 "client: %V, request: \"%V\"",
-                 &blocked_version, &r->connection->addr_text,
-                 &r->request_line);
+    bmcf = ngx_http_get_module_main_conf(r, ngx_http_block_legacy_module);
 
-    /* Prepare response */
-    r->headers_out.status = 426;  /* 426 Upgrade Required */
-    r->headers_out.content_length_n = -1;
+    c = r->connection;
 
-    /* Add required headers for 426 response */
-    ngx_table_elt_t *upgrade_header = ngx_list_push(&r->headers_out.headers);
-    if (upgrade_header != NULL) {
-        upgrade_header->hash = 1;
-        ngx_str_set(&upgrade_header->key, "Upgrade");
-        ngx_str_set(&upgrade_header->value, "HTTP/2.0, HTTP/1.1");
+#if (NGX_HTTP_V2)
+    if (r->stream) {
+        c = r->stream->connection->connection;
     }
+#endif
 
-    ngx_table_elt_t *connection_header = ngx_list_push(&r->headers_out.headers);
-    if (connection_header != NULL) {
-        connection_header->hash = 1;
-        ngx_str_set(&connection_header->key, "Connection");
-        ngx_str_set(&connection_header->value, "Upgrade");
+    if (bmcf->traced == NULL
+        || c < ngx_cycle->connections
+        || c >= ngx_cycle->connections + ngx_cycle->connection_n)
+    {
+        return ngx_cidr_match(c->sockaddr, bmcf->trace) == NGX_OK;
     }
 
-    /* Send headers */
-    ngx_int_t rc = ngx_http_send_header(r);
-    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-        return rc;
+    t = &bmcf->traced[c - ngx_cycle->connections];
+
+    if (t->number != c->number) {
+        t->number = c->number;
+        t->match = (ngx_cidr_match(c->sockaddr, bmcf->trace) == NGX_OK);
     }
 
-    /* Prepare response body */
-    if (conf->custom_message.len > 0) {
-        response_body = conf->custom_message;
-    } else {
-        /* Default message */
-        u_char *default_msg = (u_char*)
-            "<!DOCTYPE html>\n"
-            "<html>\n"
-            "<head><title>426 Upgrade Required</title></head>\n"
-            "<body>\n"
-            "<center><h1>426 Upgrade Required</h1></center>\n"
-            "<hr>\n"
-            "<center>This server requires HTTP/2.0 or HTTP/1.1</center>\n"
-            "<center>Your client used: ";
+    return t->match;
+}
 
-        size_t total_len = ngx_strlen(default_msg) + blocked_version.len +
-                          ngx_strlen("</center>\n</body>\n</html>\n");
+/*
+ * Evaluators chosen per location by ngx_http_block_legacy_merge_conf().
+ * The general one implements every feature, the others are shortcuts for
+ * locations that need only part of it.
+ */
 
-        u_char *full_msg = ngx_pnalloc(r->pool, total_len);
-        if (full_msg == NULL) {
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
+static ngx_int_t
+ngx_http_block_legacy_never(ngx_http_request_t *r,
+    ngx_http_block_legacy_conf_t *conf)
+{
+    return NGX_DECLINED;
+}
 
-        u_char *p = full_msg;
-        p = ngx_cpymem(p, default_msg, ngx_strlen(default_msg));
-        p = ngx_cpymem(p, blocked_version.data, blocked_version.len);
-        p = ngx_cpymem(p, "</center>\n</body>\n</html>\n",
-                      ngx_strlen("</center>\n</body>\n</html>\n"));
+/* per-version flags only */
 
-        response_body.data = full_msg;
-        response_body.len = total_len;
-    }
+static ngx_int_t
+ngx_http_block_legacy_mask(ngx_http_request_t *r,
+    ngx_http_block_legacy_conf_t *conf)
+{
+    ngx_uint_t v;
 
-    /* Create buffer for response */
-    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
-    if (b == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    v = ngx_http_block_legacy_version(r->http_version);
+
+    if (conf->versions & (1 << v)) {
+        return ngx_http_block_legacy_respond(r, conf,
+                                          &ngx_http_block_legacy_versions[v]);
     }
 
-    b->pos = response_body.data;
-    b->last = response_body.data + response_body.len;
-    b->memory = 1;
-    b->last_buf = 1;
+    return conf->hooks ? ngx_http_block_legacy_allowed(r, 0) : NGX_DECLINED;
+}
 
-    out.buf = b;
-    out.next = NULL;
+/* per-version flags with the HTTP/1.1 exemptions */
 
-    r->headers_out.content_length_n = response_body.len;
+static ngx_int_t
+ngx_http_block_legacy_mask_exempt(ngx_http_request_t *r,
+    ngx_http_block_legacy_conf_t *conf)
+{
+    ngx_uint_t v;
 
-    return ngx_http_output_filter(r, &out);
-}
+    v = ngx_http_block_legacy_version(r->http_version);
+
+    if ((conf->versions & (1 << v))
+        && !(v == NGX_HTTP_BLOCK_LEGACY_V11
+             && ((conf->allow_websocket && ngx_http_block_legacy_websocket(r))
+                 || (conf->h2_fallback
+                     && ngx_http_block_legacy_h2_capable(r)))))
+    {
+        return ngx_http_block_legacy_respond(r, conf,
+                                          &ngx_http_block_legacy_versions[v]);
+    }
+
+    return conf->hooks ? ngx_http_block_legacy_allowed(r, 0) : NGX_DECLINED;
+}
+
+static ngx_int_t
+ngx_http_block_legacy_general(ngx_http_request_t *r,
+    ngx_http_block_legacy_conf_t *conf)
+{
+    ngx_int_t should_block = 0;
+    ngx_str_t blocked_version = ngx_null_string;
+    ngx_uint_t trace = 0;
+    ngx_uint_t action = NGX_HTTP_BLOCK_LEGACY_NONE;
+    ngx_uint_t challenge = 0;
+    struct timeval tv;
+    uint64_t start = 0;
+
+    /* Per-client decision tracing, a flag test when unused */
+    if (conf->tracing
+        && (conf->trace_all
+            || (conf->trace != NULL
+                && ngx_http_block_legacy_traced(r)
+                && ngx_cidr_match(r->connection->sockaddr, conf->trace)
+                   == NGX_OK)))
+    {
+        trace = 1;
+        ngx_gettimeofday(&tv);
+        start = (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+
+        ngx_http_block_legacy_trace(r, "client %V, request: \"%V\", "
+                                    "enable=%i block_http09=%i "
+                                    "block_http10=%i block_http11=%i",
+                                    &r->connection->addr_text,
+                                    &r->request_line, conf->enable,
+                                    conf->block_http09, conf->block_http10,
+                                    conf->block_http11);
+    }
+
+    /* Check if module is enabled */
+    if (!conf->enable) {
+        if (trace) {
+            ngx_http_block_legacy_trace(r, "module disabled, allowed");
+        }
+        return NGX_DECLINED;
+    }
+
+    /* Compiled rules take precedence over the version policy */
+    if (conf->rules != NULL) {
+        action = ngx_http_block_legacy_rules(r, conf->rules, trace);
+
+        if (action == NGX_HTTP_BLOCK_LEGACY_BLOCK
+            || action == NGX_HTTP_BLOCK_LEGACY_CHALLENGE)
+        {
+            should_block = 1;
+
+            blocked_version.data = ngx_pnalloc(r->pool,
+                                               sizeof("HTTP/") - 1
+                                               + 2 * NGX_INT_T_LEN + 1);
+            if (blocked_version.data == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            blocked_version.len = ngx_sprintf(blocked_version.data,
+                                              "HTTP/%ui.%ui", r->http_major,
+                                              r->http_minor)
+                                  - blocked_version.data;
+        }
+    }
+
+    /* Check which HTTP version to block */
+    if (action == NGX_HTTP_BLOCK_LEGACY_NONE) {
+        switch (r->http_version) {
+            case NGX_HTTP_VERSION_9:
+                if (conf->block_http09) {
+                    should_block = 1;
+                    ngx_str_set(&blocked_version, "HTTP/0.9");
+                }
+                break;
+
+            case NGX_HTTP_VERSION_10:
+                if (conf->block_http10) {
+                    should_block = 1;
+                    ngx_str_set(&blocked_version, "HTTP/1.0");
+                }
+                break;
+
+            case NGX_HTTP_VERSION_11:
+                if (conf->block_http11) {
+                    if (conf->allow_websocket
+                        && ngx_http_block_legacy_websocket(r))
+                    {
+                        if (trace) {
+                            ngx_http_block_legacy_trace(r, "WebSocket handshake "
+                                                        "exempt from "
+                                                        "block_http11");
+                        }
+                        break;
+                    }
+
+                    if (conf->h2_fallback
+                        && ngx_http_block_legacy_h2_capable(r))
+                    {
+                        if (trace) {
+                            ngx_http_block_legacy_trace(r, "client recently "
+                                                        "used HTTP/2 or "
+                                                        "HTTP/3, exempt from "
+                                                        "block_http11");
+                        }
+                        break;
+                    }
+
+                    should_block = 1;
+                    ngx_str_set(&blocked_version, "HTTP/1.1");
+                }
+                break;
+
+            default:
+                /*
+                 * HTTP/2.0+ are allowed, including WebSocket bootstrapped
+                 * with RFC 8441 extended CONNECT
+                 */
+                ngx_http_block_legacy_remember(r);
+
+                if (trace) {
+                    ngx_http_block_legacy_trace(r, "version %ui.%ui is modern, "
+                                                "allowed",
+                                                r->http_major, r->http_minor);
+                }
+                return NGX_DECLINED;
+        }
+    }
+
+    /*
+     * A challenged request is allowed if it carries a valid cookie.
+     * HTTP/0.9 has no headers and is simply blocked.
+     */
+    if (should_block
+        && r->http_version > NGX_HTTP_VERSION_9
+        && (action == NGX_HTTP_BLOCK_LEGACY_CHALLENGE
+            || (action == NGX_HTTP_BLOCK_LEGACY_NONE && conf->challenge)))
+    {
+        challenge = 1;
+
+        if (ngx_http_block_legacy_verify(r, trace) == NGX_OK) {
+            should_block = 0;
+        }
+    }
+
+    if (trace) {
+        ngx_gettimeofday(&tv);
+        ngx_http_block_legacy_trace(r, "version %ui.%ui %s by %s, "
+                                    "decided in %uLus",
+                                    r->http_major, r->http_minor,
+                                    should_block
+                                    ? (challenge ? "challenged" : "blocked")
+                                    : "allowed",
+                                    challenge ? "cookie"
+                                    : action == NGX_HTTP_BLOCK_LEGACY_NONE
+                                    ? "version policy" : "rule",
+                                    (uint64_t) tv.tv_sec * 1000000
+                                    + tv.tv_usec - start);
+    }
+
+    if (!should_block) {
+        return ngx_http_block_legacy_allowed(r, trace);
+    }
+
+    if (challenge) {
+        return ngx_http_block_legacy_send_challenge(r);
+    }
+
+    return ngx_http_block_legacy_respond(r, conf, &blocked_version);
+}
+
+/* Per-client state kept for allowed requests */
+
+static ngx_int_t
+ngx_http_block_legacy_allowed(ngx_http_request_t *r, ngx_uint_t trace)
+{
+    if (r->http_version < NGX_HTTP_VERSION_20) {
+        ngx_http_block_legacy_classify(r, trace);
+        ngx_http_block_legacy_track(r);
+
+    } else {
+        ngx_http_block_legacy_remember(r);
+    }
+
+    return NGX_DECLINED;
+}
+
+static ngx_int_t
+ngx_http_block_legacy_respond(ngx_http_request_t *r,
+    ngx_http_block_legacy_conf_t *conf, ngx_str_t *blocked_version)
+{
+    ngx_str_t response_body;
+    ngx_buf_t *b;
+    ngx_chain_t out;
+    ngx_http_block_legacy_main_conf_t *bmcf;
+
+    bmcf = ngx_http_get_module_main_conf(r, ngx_http_block_legacy_module);
+
+    /* Log blocked request, the synthetic probe expects to be blocked */
+    if (!ngx_http_block_legacy_is_probe(bmcf, r->connection->sockaddr)) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                     "%V request blocked by security policy, "
+                     "client: %V, request: \"%V\"",
+                     blocked_version, &r->connection->addr_text,
+                     &r->request_line);
+    }
+
+    /*
+     * Only a rule blocks HTTP/2 and HTTP/3; there is nothing to upgrade
+     * to, and Upgrade and Connection are forbidden there
+     */
+    if (r->http_version >= NGX_HTTP_VERSION_20) {
+        return NGX_HTTP_FORBIDDEN;
+    }
+
+    /* Prepare response */
+    r->headers_out.status = 426;  /* 426 Upgrade Required */
+    r->headers_out.content_length_n = -1;
+
+    /* Add required headers for 426 response */
+    ngx_table_elt_t *upgrade_header = ngx_list_push(&r->headers_out.headers);
+    if (upgrade_header != NULL) {
+        upgrade_header->hash = 1;
+        ngx_str_set(&upgrade_header->key, "Upgrade");
+        ngx_str_set(&upgrade_header->value, "HTTP/2.0, HTTP/1.1");
+    }
+
+    ngx_table_elt_t *connection_header = ngx_list_push(&r->headers_out.headers);
+    if (connection_header != NULL) {
+        connection_header->hash = 1;
+        ngx_str_set(&connection_header->key, "Connection");
+        ngx_str_set(&connection_header->value, "Upgrade");
+    }
+
+    /* Send headers */
+    ngx_int_t rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    /* Prepare response body */
+    if (conf->custom_message.len > 0) {
+        response_body = conf->custom_message;
+    } else {
+        /* Default message */
+        u_char *default_msg = (u_char*)
+            "<!DOCTYPE html>\n"
+            "<html>\n"
+            "<head><title>426 Upgrade Required</title></head>\n"
+            "<body>\n"
+            "<center><h1>426 Upgrade Required</h1></center>\n"
+            "<hr>\n"
+            "<center>This server requires HTTP/2.0 or HTTP/1.1</center>\n"
+            "<center>Your client used: ";
+
+        size_t total_len = ngx_strlen(default_msg) + blocked_version->len +
+                          ngx_strlen("</center>\n</body>\n</html>\n");
+
+        u_char *full_msg = ngx_pnalloc(r->pool, total_len);
+        if (full_msg == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        u_char *p = full_msg;
+        p = ngx_cpymem(p, default_msg, ngx_strlen(default_msg));
+        p = ngx_cpymem(p, blocked_version->data, blocked_version->len);
+        p = ngx_cpymem(p, "</center>\n</body>\n</html>\n",
+                      ngx_strlen("</center>\n</body>\n</html>\n"));
+
+        response_body.data = full_msg;
+        response_body.len = total_len;
+    }
+
+    /* Create buffer for response */
+    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->pos = response_body.data;
+    b->last = response_body.data + response_body.len;
+    b->memory = 1;
+    b->last_buf = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    r->headers_out.content_length_n = response_body.len;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+static void *
+ngx_http_block_legacy_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_block_legacy_main_conf_t *bmcf;
+
+    bmcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_block_legacy_main_conf_t));
+    if (bmcf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     bmcf->shm_zone = NULL;
+     *     bmcf->conn_rate = 0;
+     *     bmcf->conn_burst = 0;
+     *     bmcf->probe = NULL;
+     */
+
+    bmcf->shutdown_close = NGX_CONF_UNSET_MSEC;
+    bmcf->reclaim = NGX_CONF_UNSET;
+    bmcf->accept_batch = NGX_CONF_UNSET;
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     bmcf->challenge = 0;
+     *     bmcf->challenge_secret = { 0, NULL };
+     *     bmcf->tokens = NULL;
+     *     bmcf->h2_fingerprint = NULL;
+     *     bmcf->seen = NULL;
+     */
+
+    bmcf->h2_memory = NGX_CONF_UNSET_MSEC;
+
+    return bmcf;
+}
+
+static char *
+ngx_http_block_legacy_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_block_legacy_main_conf_t *bmcf = conf;
+
+    if (bmcf->conn_rate && bmcf->shm_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"block_legacy_conn_rate\" requires "
+                           "\"block_legacy_zone\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (bmcf->probe && bmcf->shm_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"block_legacy_probe\" requires "
+                           "\"block_legacy_zone\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (bmcf->h2_memory != NGX_CONF_UNSET_MSEC && bmcf->shm_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"block_legacy_h2_memory\" requires "
+                           "\"block_legacy_zone\"");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_init_msec_value(bmcf->h2_memory, 0);
+    ngx_conf_init_value(bmcf->reclaim, 0);
+    ngx_conf_init_value(bmcf->accept_batch, 0);
+
+    bmcf->registry = (bmcf->shutdown_close != NGX_CONF_UNSET_MSEC
+                      || bmcf->reclaim);
+
+    if (bmcf->challenge) {
+        if (ngx_http_block_legacy_challenge_key(cf, bmcf) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        bmcf->tokens = ngx_pcalloc(cf->pool,
+                                   NGX_HTTP_BLOCK_LEGACY_TOKENS
+                                   * sizeof(ngx_http_block_legacy_token_t));
+        if (bmcf->tokens == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (bmcf->h2_memory) {
+        bmcf->seen = ngx_pcalloc(cf->pool,
+                                 NGX_HTTP_BLOCK_LEGACY_SEEN
+                                 * sizeof(ngx_http_block_legacy_seen_t));
+        if (bmcf->seen == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        bmcf->capable = ngx_pcalloc(cf->pool,
+                                    NGX_HTTP_BLOCK_LEGACY_CAPABLE
+                                    * sizeof(ngx_http_block_legacy_capable_t));
+        if (bmcf->capable == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
 
 static void *
 ngx_http_block_legacy_create_conf(ngx_conf_t *cf)
@@ -238,6 +1201,12 @@ ngx_http_block_legacy_create_conf(ngx_conf_t *cf)
     conf->block_http10 = NGX_CONF_UNSET;
     conf->block_http11 = NGX_CONF_UNSET;
     conf->block_http09 = NGX_CONF_UNSET;
+    conf->trace = NGX_CONF_UNSET_PTR;
+    conf->trace_all = NGX_CONF_UNSET;
+    conf->allow_websocket = NGX_CONF_UNSET;
+    conf->rules = NGX_CONF_UNSET_PTR;
+    conf->challenge = NGX_CONF_UNSET;
+    conf->h2_fallback = NGX_CONF_UNSET;
 
     return conf;
 }
@@ -247,6 +1216,7 @@ ngx_http_block_legacy_merge_conf(ngx_conf_t *cf, void *parent, void *child)
 {
     ngx_http_block_legacy_conf_t *prev = parent;
     ngx_http_block_legacy_conf_t *conf = child;
+    ngx_http_block_legacy_main_conf_t *bmcf;
 
     ngx_conf_merge_value(conf->enable, prev->enable, 0);
     ngx_conf_merge_value(conf->block_http10, prev->block_http10, 1);
@@ -261,6 +1231,51 @@ ngx_http_block_legacy_merge_conf(ngx_conf_t *cf, void *parent, void *child)
     }
 
     ngx_conf_merge_str_value(conf->custom_message, prev->custom_message, "");
+    ngx_conf_merge_ptr_value(conf->trace, prev->trace, NULL);
+    ngx_conf_merge_value(conf->trace_all, prev->trace_all, 0);
+    ngx_conf_merge_value(conf->allow_websocket, prev->allow_websocket, 0);
+    ngx_conf_merge_ptr_value(conf->rules, prev->rules, NULL);
+    ngx_conf_merge_value(conf->challenge, prev->challenge, 0);
+    ngx_conf_merge_value(conf->h2_fallback, prev->h2_fallback, 0);
+
+    bmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_block_legacy_module);
+
+    if (conf->h2_fallback && bmcf->h2_memory == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"block_legacy_h2_fallback\" requires "
+                           "\"block_legacy_h2_memory\"");
+        return NGX_CONF_ERROR;
+    }
+
+    conf->versions = (conf->block_http09 << NGX_HTTP_BLOCK_LEGACY_V09)
+                     | (conf->block_http10 << NGX_HTTP_BLOCK_LEGACY_V10)
+                     | (conf->block_http11 << NGX_HTTP_BLOCK_LEGACY_V11);
+
+    conf->hooks = (bmcf->conn_rate || bmcf->registry || bmcf->h2_memory);
+    conf->tracing = (conf->trace != NULL || conf->trace_all);
+
+    /*
+     * pick the cheapest evaluator that implements this location's policy,
+     * the handler switches traced clients to the general one
+     */
+
+    if (!conf->enable) {
+        conf->evaluate = ngx_http_block_legacy_never;
+
+    } else if (conf->rules != NULL || conf->challenge) {
+        conf->evaluate = ngx_http_block_legacy_general;
+
+    } else if (conf->versions == 0 && !conf->hooks) {
+        conf->evaluate = ngx_http_block_legacy_never;
+
+    } else if ((conf->versions & (1 << NGX_HTTP_BLOCK_LEGACY_V11))
+               && (conf->allow_websocket || conf->h2_fallback))
+    {
+        conf->evaluate = ngx_http_block_legacy_mask_exempt;
+
+    } else {
+        conf->evaluate = ngx_http_block_legacy_mask;
+    }
 
     return NGX_CONF_OK;
 }
@@ -281,20 +1296,3292 @@ ngx_http_block_legacy_custom_message(ngx_conf_t *cf, ngx_command_t *cmd, void *c
     return NGX_CONF_OK;
 }
 
-static ngx_int_t
-ngx_http_block_legacy_init(ngx_conf_t *cf)
+static char *
+ngx_http_block_legacy_trace_cidr(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_handler_pt        *h;
-    ngx_http_core_main_conf_t  *cmcf;
+    ngx_http_block_legacy_main_conf_t *bmcf;
+    ngx_http_block_legacy_conf_t *blcf = conf;
+    ngx_str_t *value;
+    ngx_cidr_t *cidr;
+    ngx_int_t rc;
 
-    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+    value = cf->args->elts;
 
-    h = ngx_array_push(&cmcf->phases[NGX_HTTP_REWRITE_PHASE].handlers);
-    if (h == NULL) {
-        return NGX_ERROR;
+    if (ngx_strcmp(value[1].data, "all") == 0) {
+        blcf->trace_all = 1;
+        return NGX_CONF_OK;
     }
 
-    *h = ngx_http_block_legacy_handler;
+    if (blcf->trace == NGX_CONF_UNSET_PTR) {
+        blcf->trace = ngx_array_create(cf->pool, 2, sizeof(ngx_cidr_t));
+        if (blcf->trace == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
 
-    return NGX_OK;
+    cidr = ngx_array_push(blcf->trace);
+    if (cidr == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    rc = ngx_ptocidr(&value[1], cidr);
+
+    if (rc == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid network \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (rc == NGX_DONE) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "low address bits of %V are meaningless",
+                           &value[1]);
+    }
+
+    bmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_block_legacy_module);
+
+    if (bmcf->trace == NULL) {
+        bmcf->trace = ngx_array_create(cf->pool, 2, sizeof(ngx_cidr_t));
+        if (bmcf->trace == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (ngx_array_push(bmcf->trace) == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ((ngx_cidr_t *) bmcf->trace->elts)[bmcf->trace->nelts - 1] = *cidr;
+
+    return NGX_CONF_OK;
+}
+
+static ngx_uint_t
+ngx_http_block_legacy_websocket(ngx_http_request_t *r)
+{
+    ngx_uint_t i, key, version;
+    ngx_list_part_t *part;
+    ngx_table_elt_t *h;
+
+    /* a WebSocket opening handshake, RFC 6455 section 4.1 */
+
+    h = r->headers_in.upgrade;
+
+    if (h == NULL || r->method != NGX_HTTP_GET) {
+        return 0;
+    }
+
+    if (ngx_strlcasestrn(h->value.data, h->value.data + h->value.len,
+                         (u_char *) "websocket", 9 - 1)
+        == NULL)
+    {
+        return 0;
+    }
+
+    h = r->headers_in.connection;
+
+    if (h == NULL
+        || ngx_strlcasestrn(h->value.data, h->value.data + h->value.len,
+                            (u_char *) "upgrade", 7 - 1)
+           == NULL)
+    {
+        return 0;
+    }
+
+    /*
+     * a base64-encoded 16-byte nonce and version 13; anything else is
+     * not a handshake a WebSocket server would accept
+     */
+
+    key = 0;
+    version = 0;
+
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].key.len == sizeof("Sec-WebSocket-Key") - 1
+            && ngx_strncasecmp(h[i].key.data, (u_char *) "Sec-WebSocket-Key",
+                               sizeof("Sec-WebSocket-Key") - 1)
+               == 0)
+        {
+            key = (h[i].value.len == 24);
+            continue;
+        }
+
+        if (h[i].key.len == sizeof("Sec-WebSocket-Version") - 1
+            && ngx_strncasecmp(h[i].key.data,
+                               (u_char *) "Sec-WebSocket-Version",
+                               sizeof("Sec-WebSocket-Version") - 1)
+               == 0)
+        {
+            version = (h[i].value.len == 2
+                       && h[i].value.data[0] == '1'
+                       && h[i].value.data[1] == '3');
+        }
+    }
+
+    return key && version;
+}
+
+static char *
+ngx_http_block_legacy_rule(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_block_legacy_conf_t *blcf = conf;
+    ngx_str_t *value, *tok;
+    ngx_uint_t i;
+    ngx_array_t tokens, code;
+    u_char *p, *q, *last;
+    ngx_http_block_legacy_rule_t *rule;
+    ngx_http_block_legacy_compiler_t cc;
+    ngx_http_block_legacy_main_conf_t *bmcf;
+
+    if (blcf->rules == NGX_CONF_UNSET_PTR) {
+        blcf->rules = ngx_array_create(cf->pool, 2,
+                                       sizeof(ngx_http_block_legacy_rule_t));
+        if (blcf->rules == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    rule = ngx_array_push(blcf->rules);
+    if (rule == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(rule, sizeof(ngx_http_block_legacy_rule_t));
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "allow") == 0) {
+        rule->action = NGX_HTTP_BLOCK_LEGACY_ALLOW;
+
+    } else if (ngx_strcmp(value[1].data, "block") == 0) {
+        rule->action = NGX_HTTP_BLOCK_LEGACY_BLOCK;
+
+    } else if (ngx_strcmp(value[1].data, "challenge") == 0) {
+        rule->action = NGX_HTTP_BLOCK_LEGACY_CHALLENGE;
+
+        bmcf = ngx_http_conf_get_module_main_conf(cf,
+                                                  ngx_http_block_legacy_module);
+        bmcf->challenge = 1;
+
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid action \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_array_init(&rule->nets, cf->pool, 1, sizeof(ngx_cidr_t))
+        != NGX_OK
+        || ngx_array_init(&rule->headers, cf->pool, 1, sizeof(ngx_str_t))
+           != NGX_OK
+        || ngx_array_init(&tokens, cf->temp_pool, 8, sizeof(ngx_str_t))
+           != NGX_OK
+        || ngx_array_init(&code, cf->pool, 8,
+                          sizeof(ngx_http_block_legacy_op_t))
+           != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    /* split parentheses off the arguments, the rest are whole tokens */
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        p = value[i].data;
+        last = p + value[i].len;
+
+        for ( /* void */ ; p < last && *p == '('; p++) {
+            tok = ngx_array_push(&tokens);
+            if (tok == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_str_set(tok, "(");
+        }
+
+        for (q = last; q > p && q[-1] == ')'; q--) { /* void */ }
+
+        if (q > p) {
+            tok = ngx_array_push(&tokens);
+            if (tok == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            tok->data = p;
+            tok->len = q - p;
+        }
+
+        for ( /* void */ ; q < last; q++) {
+            tok = ngx_array_push(&tokens);
+            if (tok == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_str_set(tok, ")");
+        }
+    }
+
+    cc.cf = cf;
+    cc.tokens = tokens.elts;
+    cc.ntokens = tokens.nelts;
+    cc.pos = 0;
+    cc.code = &code;
+    cc.rule = rule;
+
+    if (ngx_http_block_legacy_compile_or(&cc) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (cc.pos != cc.ntokens) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "unexpected \"%V\" in rule", &cc.tokens[cc.pos]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_block_legacy_emit(&cc, NGX_HTTP_BLOCK_LEGACY_OP_END, 0, 0)
+        == NGX_ERROR)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    rule->code = code.elts;
+
+    /* keep the source for decision traces */
+
+    rule->text.len = 0;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        rule->text.len += value[i].len + 1;
+    }
+
+    rule->text.data = ngx_pnalloc(cf->pool, rule->text.len);
+    if (rule->text.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    p = rule->text.data;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        p = ngx_cpymem(p, value[i].data, value[i].len);
+        *p++ = ' ';
+    }
+
+    rule->text.len--;
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_block_legacy_compile_or(ngx_http_block_legacy_compiler_t *cc)
+{
+    ngx_int_t chain;
+
+    chain = NGX_HTTP_BLOCK_LEGACY_NO_JUMP;
+
+    if (ngx_http_block_legacy_compile_and(cc) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    while (cc->pos < cc->ntokens
+           && cc->tokens[cc->pos].len == 2
+           && ngx_strncmp(cc->tokens[cc->pos].data, "or", 2) == 0)
+    {
+        cc->pos++;
+
+        chain = ngx_http_block_legacy_emit(cc, NGX_HTTP_BLOCK_LEGACY_OP_JT,
+                                           chain, 0);
+        if (chain == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_block_legacy_compile_and(cc) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_http_block_legacy_patch(cc, chain);
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_block_legacy_compile_and(ngx_http_block_legacy_compiler_t *cc)
+{
+    ngx_int_t chain;
+
+    chain = NGX_HTTP_BLOCK_LEGACY_NO_JUMP;
+
+    if (ngx_http_block_legacy_compile_unary(cc) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    while (cc->pos < cc->ntokens
+           && cc->tokens[cc->pos].len == 3
+           && ngx_strncmp(cc->tokens[cc->pos].data, "and", 3) == 0)
+    {
+        cc->pos++;
+
+        chain = ngx_http_block_legacy_emit(cc, NGX_HTTP_BLOCK_LEGACY_OP_JF,
+                                           chain, 0);
+        if (chain == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_block_legacy_compile_unary(cc) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_http_block_legacy_patch(cc, chain);
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_block_legacy_compile_unary(ngx_http_block_legacy_compiler_t *cc)
+{
+    ngx_str_t *tok;
+
+    if (cc->pos == cc->ntokens) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cc->cf, 0,
+                           "unexpected end of rule");
+        return NGX_ERROR;
+    }
+
+    tok = &cc->tokens[cc->pos++];
+
+    if (tok->len == 3 && ngx_strncmp(tok->data, "not", 3) == 0) {
+
+        if (ngx_http_block_legacy_compile_unary(cc) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        return ngx_http_block_legacy_emit(cc, NGX_HTTP_BLOCK_LEGACY_OP_NOT,
+                                          0, 0)
+               == NGX_ERROR ? NGX_ERROR : NGX_OK;
+    }
+
+    if (tok->len == 1 && tok->data[0] == '(') {
+
+        if (ngx_http_block_legacy_compile_or(cc) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (cc->pos == cc->ntokens
+            || cc->tokens[cc->pos].len != 1
+            || cc->tokens[cc->pos].data[0] != ')')
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cc->cf, 0,
+                               "missing \")\" in rule");
+            return NGX_ERROR;
+        }
+
+        cc->pos++;
+
+        return NGX_OK;
+    }
+
+    return ngx_http_block_legacy_compile_predicate(cc, tok);
+}
+
+static ngx_int_t
+ngx_http_block_legacy_compile_predicate(ngx_http_block_legacy_compiler_t *cc,
+    ngx_str_t *tok)
+{
+    u_char *p, *last;
+    ngx_int_t rc, h1, m1, h2, m2;
+    ngx_str_t name, arg, *header;
+    ngx_uint_t i, op, val, mask;
+    ngx_cidr_t *cidr;
+
+    static ngx_conf_enum_t versions[] = {
+        { ngx_string("0.9"), NGX_HTTP_VERSION_9 },
+        { ngx_string("1.0"), NGX_HTTP_VERSION_10 },
+        { ngx_string("1.1"), NGX_HTTP_VERSION_11 },
+        { ngx_string("2.0"), NGX_HTTP_VERSION_20 },
+#ifdef NGX_HTTP_VERSION_30
+        { ngx_string("3.0"), NGX_HTTP_VERSION_30 },
+#endif
+        { ngx_null_string, 0 }
+    };
+
+    static ngx_conf_enum_t methods[] = {
+        { ngx_string("GET"), NGX_HTTP_GET },
+        { ngx_string("HEAD"), NGX_HTTP_HEAD },
+        { ngx_string("POST"), NGX_HTTP_POST },
+        { ngx_string("PUT"), NGX_HTTP_PUT },
+        { ngx_string("DELETE"), NGX_HTTP_DELETE },
+        { ngx_string("OPTIONS"), NGX_HTTP_OPTIONS },
+        { ngx_string("PATCH"), NGX_HTTP_PATCH },
+        { ngx_string("TRACE"), NGX_HTTP_TRACE },
+        { ngx_string("CONNECT"), NGX_HTTP_CONNECT },
+        { ngx_null_string, 0 }
+    };
+
+    if (tok->len == 9 && ngx_strncmp(tok->data, "websocket", 9) == 0) {
+        return ngx_http_block_legacy_emit(cc,
+                                          NGX_HTTP_BLOCK_LEGACY_OP_WEBSOCKET,
+                                          0, 0)
+               == NGX_ERROR ? NGX_ERROR : NGX_OK;
+    }
+
+    p = ngx_strlchr(tok->data, tok->data + tok->len, '=');
+    if (p == NULL) {
+        goto invalid;
+    }
+
+    name.data = tok->data;
+    name.len = p - tok->data;
+    arg.data = p + 1;
+    arg.len = tok->data + tok->len - arg.data;
+
+    if (arg.len == 0) {
+        goto invalid;
+    }
+
+    if (name.len == 7 && ngx_strncmp(name.data, "version", 7) == 0) {
+        op = NGX_HTTP_BLOCK_LEGACY_OP_VERSION;
+
+        for (i = 0; versions[i].name.len; i++) {
+            if (versions[i].name.len == arg.len
+                && ngx_strncmp(versions[i].name.data, arg.data, arg.len) == 0)
+            {
+                break;
+            }
+        }
+
+        if (versions[i].name.len == 0) {
+            goto invalid;
+        }
+
+        val = versions[i].value;
+
+    } else if (name.len == 6 && ngx_strncmp(name.data, "method", 6) == 0) {
+        op = NGX_HTTP_BLOCK_LEGACY_OP_METHOD;
+        val = 0;
+
+        /* a comma separated list of methods */
+
+        last = arg.data + arg.len;
+
+        for (p = arg.data; p < last; p = arg.data + arg.len + 1) {
+            arg.data = p;
+            arg.len = last - p;
+
+            p = ngx_strlchr(p, last, ',');
+            if (p != NULL) {
+                arg.len = p - arg.data;
+            }
+
+            mask = 0;
+
+            for (i = 0; methods[i].name.len; i++) {
+                if (methods[i].name.len == arg.len
+                    && ngx_strncmp(methods[i].name.data, arg.data, arg.len)
+                       == 0)
+                {
+                    mask = methods[i].value;
+                    break;
+                }
+            }
+
+            if (mask == 0) {
+                goto invalid;
+            }
+
+            val |= mask;
+        }
+
+    } else if (name.len == 6 && ngx_strncmp(name.data, "header", 6) == 0) {
+        op = NGX_HTTP_BLOCK_LEGACY_OP_HEADER;
+        val = cc->rule->headers.nelts;
+
+        header = ngx_array_push(&cc->rule->headers);
+        if (header == NULL) {
+            return NGX_ERROR;
+        }
+
+        *header = arg;
+
+    } else if (name.len == 3 && ngx_strncmp(name.data, "net", 3) == 0) {
+        op = NGX_HTTP_BLOCK_LEGACY_OP_NET;
+        val = cc->rule->nets.nelts;
+
+        cidr = ngx_array_push(&cc->rule->nets);
+        if (cidr == NULL) {
+            return NGX_ERROR;
+        }
+
+        rc = ngx_ptocidr(&arg, cidr);
+
+        if (rc == NGX_ERROR) {
+            goto invalid;
+        }
+
+        if (rc == NGX_DONE) {
+            ngx_conf_log_error(NGX_LOG_WARN, cc->cf, 0,
+                               "low address bits of %V are meaningless",
+                               &arg);
+        }
+
+    } else if (name.len == 4 && ngx_strncmp(name.data, "time", 4) == 0) {
+        op = NGX_HTTP_BLOCK_LEGACY_OP_TIME;
+
+        /* "HH:MM-HH:MM" in local time, may wrap around midnight */
+
+        if (arg.len != 11 || arg.data[2] != ':' || arg.data[5] != '-'
+            || arg.data[8] != ':')
+        {
+            goto invalid;
+        }
+
+        h1 = ngx_atoi(arg.data, 2);
+        m1 = ngx_atoi(arg.data + 3, 2);
+        h2 = ngx_atoi(arg.data + 6, 2);
+        m2 = ngx_atoi(arg.data + 9, 2);
+
+        if (h1 == NGX_ERROR || h1 > 23 || m1 == NGX_ERROR || m1 > 59
+            || h2 == NGX_ERROR || m2 == NGX_ERROR || m2 > 59
+            || (h2 > 23 && !(h2 == 24 && m2 == 0)))
+        {
+            goto invalid;
+        }
+
+        val = (h1 * 60 + m1) << 16 | (h2 * 60 + m2);
+
+    } else {
+        goto invalid;
+    }
+
+    return ngx_http_block_legacy_emit(cc, op, 0, val) == NGX_ERROR
+           ? NGX_ERROR : NGX_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cc->cf, 0,
+                       "invalid condition \"%V\" in rule", tok);
+    return NGX_ERROR;
+}
+
+static ngx_int_t
+ngx_http_block_legacy_emit(ngx_http_block_legacy_compiler_t *cc,
+    ngx_uint_t op, ngx_uint_t jump, ngx_uint_t arg)
+{
+    ngx_http_block_legacy_op_t *code;
+
+    if (cc->code->nelts >= NGX_HTTP_BLOCK_LEGACY_NO_JUMP) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cc->cf, 0, "rule is too long");
+        return NGX_ERROR;
+    }
+
+    code = ngx_array_push(cc->code);
+    if (code == NULL) {
+        return NGX_ERROR;
+    }
+
+    code->op = (uint16_t) op;
+    code->jump = (uint16_t) jump;
+    code->arg = (uint32_t) arg;
+
+    return cc->code->nelts - 1;
+}
+
+static void
+ngx_http_block_legacy_patch(ngx_http_block_legacy_compiler_t *cc,
+    ngx_uint_t chain)
+{
+    ngx_uint_t next;
+    ngx_http_block_legacy_op_t *code;
+
+    /* pending jumps are linked through their jump fields */
+
+    code = cc->code->elts;
+
+    while (chain != NGX_HTTP_BLOCK_LEGACY_NO_JUMP) {
+        next = code[chain].jump;
+        code[chain].jump = (uint16_t) cc->code->nelts;
+        chain = next;
+    }
+}
+
+static ngx_uint_t
+ngx_http_block_legacy_rules(ngx_http_request_t *r, ngx_array_t *rules,
+    ngx_uint_t trace)
+{
+    ngx_uint_t i;
+    ngx_http_block_legacy_rule_t *rule;
+
+    rule = rules->elts;
+
+    for (i = 0; i < rules->nelts; i++) {
+
+        if (ngx_http_block_legacy_run(r, &rule[i])) {
+            if (trace) {
+                ngx_http_block_legacy_trace(r, "rule \"%V\" matched, %s",
+                                            &rule[i].text,
+                                            rule[i].action
+                                            == NGX_HTTP_BLOCK_LEGACY_ALLOW
+                                            ? "allow"
+                                            : rule[i].action
+                                              == NGX_HTTP_BLOCK_LEGACY_BLOCK
+                                              ? "block" : "challenge");
+            }
+
+            return rule[i].action;
+        }
+
+        if (trace) {
+            ngx_http_block_legacy_trace(r, "rule \"%V\" did not match",
+                                        &rule[i].text);
+        }
+    }
+
+    return NGX_HTTP_BLOCK_LEGACY_NONE;
+}
+
+static ngx_uint_t
+ngx_http_block_legacy_run(ngx_http_request_t *r,
+    ngx_http_block_legacy_rule_t *rule)
+{
+    ngx_uint_t acc, pc, now, from, to;
+    ngx_time_t *tp;
+    ngx_array_t net;
+    ngx_http_block_legacy_op_t *op;
+
+    acc = 0;
+    pc = 0;
+
+    for ( ;; ) {
+        op = &rule->code[pc++];
+
+        switch (op->op) {
+
+        case NGX_HTTP_BLOCK_LEGACY_OP_END:
+            return acc;
+
+        case NGX_HTTP_BLOCK_LEGACY_OP_JF:
+            if (!acc) {
+                pc = op->jump;
+            }
+            break;
+
+        case NGX_HTTP_BLOCK_LEGACY_OP_JT:
+            if (acc) {
+                pc = op->jump;
+            }
+            break;
+
+        case NGX_HTTP_BLOCK_LEGACY_OP_NOT:
+            acc = !acc;
+            break;
+
+        case NGX_HTTP_BLOCK_LEGACY_OP_VERSION:
+            acc = (r->http_version == op->arg);
+            break;
+
+        case NGX_HTTP_BLOCK_LEGACY_OP_METHOD:
+            acc = ((r->method & op->arg) != 0);
+            break;
+
+        case NGX_HTTP_BLOCK_LEGACY_OP_HEADER:
+            acc = ngx_http_block_legacy_has_header(r,
+                              &((ngx_str_t *) rule->headers.elts)[op->arg]);
+            break;
+
+        case NGX_HTTP_BLOCK_LEGACY_OP_NET:
+            /* a one element view, ngx_cidr_match() reads elts and nelts */
+            net.elts = &((ngx_cidr_t *) rule->nets.elts)[op->arg];
+            net.nelts = 1;
+
+            acc = (ngx_cidr_match(r->connection->sockaddr, &net) == NGX_OK);
+            break;
+
+        case NGX_HTTP_BLOCK_LEGACY_OP_TIME:
+            tp = ngx_timeofday();
+            now = ((tp->sec + tp->gmtoff * 60) / 60) % 1440;
+            from = op->arg >> 16;
+            to = op->arg & 0xffff;
+
+            acc = (from <= to) ? (now >= from && now < to)
+                               : (now >= from || now < to);
+            break;
+
+        case NGX_HTTP_BLOCK_LEGACY_OP_WEBSOCKET:
+            acc = ngx_http_block_legacy_websocket(r);
+            break;
+
+        default:
+            return 0;
+        }
+    }
+}
+
+static ngx_uint_t
+ngx_http_block_legacy_has_header(ngx_http_request_t *r, ngx_str_t *name)
+{
+    ngx_uint_t i;
+    ngx_list_part_t *part;
+    ngx_table_elt_t *h;
+
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                return 0;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].key.len == name->len
+            && ngx_strncasecmp(h[i].key.data, name->data, name->len) == 0)
+        {
+            return 1;
+        }
+    }
+}
+
+static void
+ngx_http_block_legacy_trace(ngx_http_request_t *r, const char *fmt, ...)
+{
+    u_char *p, buf[NGX_MAX_ERROR_STR];
+    va_list args;
+
+    va_start(args, fmt);
+    p = ngx_vslprintf(buf, buf + sizeof(buf), fmt, args);
+    va_end(args);
+
+    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                  "block_legacy trace: %*s", (size_t) (p - buf), buf);
+}
+
+static char *
+ngx_http_block_legacy_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_block_legacy_main_conf_t *bmcf = conf;
+    ngx_str_t *value, name, s;
+    ssize_t size;
+    u_char *p;
+    ngx_pool_cleanup_t *cln;
+    ngx_http_block_legacy_ctx_t *ctx;
+
+    if (bmcf->shm_zone != NULL) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    p = ngx_strlchr(value[1].data, value[1].data + value[1].len, ':');
+    if (p == NULL || p == value[1].data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.data = value[1].data;
+    name.len = p - value[1].data;
+
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
+
+    size = ngx_parse_size(&s);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_block_legacy_ctx_t));
+    if (ctx == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    bmcf->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                           &ngx_http_block_legacy_module);
+    if (bmcf->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (bmcf->shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    bmcf->shm_zone->init = ngx_http_block_legacy_init_zone;
+    bmcf->shm_zone->data = ctx;
+
+    if (cf->args->nelts == 2) {
+        return NGX_CONF_OK;
+    }
+
+    /* spill=path:size, the path may contain colons */
+
+    if (ngx_strncmp(value[2].data, "spill=", 6) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    for (p = value[2].data + value[2].len - 1; p > value[2].data + 6; p--) {
+        if (*p == ':') {
+            break;
+        }
+    }
+
+    if (p == value[2].data + 6) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid spill \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    ctx->spill_path.data = value[2].data + 6;
+    ctx->spill_path.len = p - ctx->spill_path.data;
+
+    s.data = p + 1;
+    s.len = value[2].data + value[2].len - s.data;
+
+    size = ngx_parse_size(&s);
+
+    if (size == NGX_ERROR
+        || size < (ssize_t) (sizeof(ngx_http_block_legacy_spill_t)
+                             + NGX_HTTP_BLOCK_LEGACY_PROBES
+                               * sizeof(ngx_http_block_legacy_slot_t)))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid spill size \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    ctx->spill_size = size;
+    ctx->spill_nslots = (size - sizeof(ngx_http_block_legacy_spill_t))
+                        / sizeof(ngx_http_block_legacy_slot_t);
+
+    if (ngx_conf_full_name(cf->cycle, &ctx->spill_path, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* the mapping is released with the last configuration using it */
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cln->handler = ngx_http_block_legacy_spill_cleanup;
+    cln->data = ctx;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_block_legacy_conn_rate(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_block_legacy_main_conf_t *bmcf = conf;
+    ngx_str_t *value, s;
+    ngx_int_t rate, scale, burst;
+    u_char *p;
+
+    if (bmcf->conn_rate) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    /* rate is "Nr/s" or "Nr/m", as in limit_req_zone */
+
+    p = value[1].data + value[1].len - 3;
+    scale = 1;
+
+    if (value[1].len > 3 && ngx_strncmp(p, "r/s", 3) == 0) {
+        /* scale = 1 */
+
+    } else if (value[1].len > 3 && ngx_strncmp(p, "r/m", 3) == 0) {
+        scale = 60;
+
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid rate \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    rate = ngx_atoi(value[1].data, value[1].len - 3);
+    if (rate <= 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid rate \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    burst = 0;
+
+    if (cf->args->nelts == 3) {
+        if (ngx_strncmp(value[2].data, "burst=", 6) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.data = value[2].data + 6;
+        s.len = value[2].len - 6;
+
+        burst = ngx_atoi(s.data, s.len);
+        if (burst == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid burst value \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    bmcf->conn_rate = rate * 1000 / scale;
+    bmcf->conn_burst = burst * 1000;
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_block_legacy_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_block_legacy_ctx_t *octx = data;
+    ngx_http_block_legacy_ctx_t *ctx;
+    size_t len, n;
+
+    ctx = shm_zone->data;
+
+    /* old workers keep using the cold table of the zone, as limit_req keys */
+
+    if (octx
+        && (ctx->spill_size != octx->spill_size
+            || ctx->spill_path.len != octx->spill_path.len
+            || ngx_strncmp(ctx->spill_path.data, octx->spill_path.data,
+                           ctx->spill_path.len)
+               != 0))
+    {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                      "block_legacy_zone \"%V\" cannot change its spill "
+                      "file on reload, use another zone name",
+                      &shm_zone->shm.name);
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_block_legacy_init_spill(shm_zone, ctx, octx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (octx) {
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+
+        return NGX_OK;
+    }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
+
+        return NGX_OK;
+    }
+
+    ctx->sh = ngx_slab_calloc(ctx->shpool,
+                              sizeof(ngx_http_block_legacy_shctx_t));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->shpool->data = ctx->sh;
+    ctx->shpool->log_nomem = 0;
+
+    if (ctx->spill_size) {
+        ctx->sh->spill_tags = ngx_slab_calloc(ctx->shpool, ctx->spill_nslots);
+        if (ctx->sh->spill_tags == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "block_legacy_zone \"%V\" is too small for "
+                          "the tags of %ui spilled clients",
+                          &shm_zone->shm.name, ctx->spill_nslots);
+            return NGX_ERROR;
+        }
+    }
+
+    /* the rest of the zone is one open-addressing table of client slots */
+
+    n = (ctx->shpool->end - ctx->shpool->start - 2 * ngx_pagesize)
+        / sizeof(ngx_http_block_legacy_slot_t);
+
+    while (n >= NGX_HTTP_BLOCK_LEGACY_PROBES) {
+        ctx->sh->slots = ngx_slab_calloc(ctx->shpool,
+                                   n * sizeof(ngx_http_block_legacy_slot_t));
+        if (ctx->sh->slots != NULL) {
+            break;
+        }
+
+        n -= n / 8 + 1;
+    }
+
+    if (ctx->sh->slots == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->sh->nslots = n;
+
+    len = sizeof(" in block_legacy zone \"\"") + shm_zone->shm.name.len;
+
+    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(ctx->shpool->log_ctx, " in block_legacy zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    ctx->shpool->log_nomem = 1;
+
+    return NGX_OK;
+}
+
+static uint32_t
+ngx_http_block_legacy_key(struct sockaddr *sa, u_char *key)
+{
+    uint32_t hash;
+    struct sockaddr_in *sin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6 *sin6;
+#endif
+
+    switch (sa->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *) sa;
+        ngx_memcpy(key, sin6->sin6_addr.s6_addr, 16);
+        break;
+#endif
+
+    case AF_INET:
+        sin = (struct sockaddr_in *) sa;
+        ngx_memzero(key, 10);
+        key[10] = 0xff;
+        key[11] = 0xff;
+        ngx_memcpy(key + 12, &sin->sin_addr.s_addr, 4);
+        break;
+
+    default:
+        /* unix sockets have no client address to key on */
+        return 0;
+    }
+
+    hash = ngx_murmur_hash2(key, 16);
+
+    return hash ? hash : 1;
+}
+
+/* the zone mutex must be held */
+
+static ngx_http_block_legacy_slot_t *
+ngx_http_block_legacy_lookup(ngx_http_block_legacy_ctx_t *ctx, u_char *key,
+    uint32_t hash, ngx_uint_t create)
+{
+    ngx_http_block_legacy_slot_t *slot, *victim, *cold, entry;
+
+    slot = ngx_http_block_legacy_find(ctx->sh->slots, ctx->sh->nslots, key,
+                                      hash, &victim);
+    if (slot != NULL) {
+        slot->access = ngx_current_msec;
+        return slot;
+    }
+
+    if (ctx->spill != NULL && ngx_http_block_legacy_spill_maybe(ctx, hash)) {
+        cold = ngx_http_block_legacy_find(ctx->spill_slots,
+                                          ctx->spill_nslots, key, hash,
+                                          &slot);
+        if (cold != NULL) {
+
+            /* promote, the hot slot it takes is demoted in turn */
+
+            entry = *cold;
+            cold->hash = 0;
+            ctx->sh->spill_tags[cold - ctx->spill_slots] = 0;
+
+            ngx_http_block_legacy_demote(ctx, victim);
+
+            *victim = entry;
+            victim->access = ngx_current_msec;
+
+            (void) ngx_atomic_fetch_add(&ctx->sh->promoted, 1);
+
+            return victim;
+        }
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    /* take an empty slot or evict the least recently used one */
+
+    if (ctx->spill != NULL) {
+        ngx_http_block_legacy_demote(ctx, victim);
+    }
+
+    ngx_memzero(victim, sizeof(ngx_http_block_legacy_slot_t));
+    ngx_memcpy(victim->addr, key, 16);
+    victim->hash = hash;
+    victim->access = ngx_current_msec;
+
+    return victim;
+}
+
+/*
+ * Probes the window of the key in a table, returns the matching slot or
+ * NULL and the slot to replace: an empty one or the least recently used.
+ */
+
+static ngx_http_block_legacy_slot_t *
+ngx_http_block_legacy_find(ngx_http_block_legacy_slot_t *slots,
+    ngx_uint_t nslots, u_char *key, uint32_t hash,
+    ngx_http_block_legacy_slot_t **victim)
+{
+    ngx_uint_t i, n;
+    ngx_http_block_legacy_slot_t *slot;
+
+    *victim = NULL;
+    n = hash % nslots;
+
+    for (i = 0; i < NGX_HTTP_BLOCK_LEGACY_PROBES; i++) {
+        slot = &slots[n];
+
+        if (slot->hash == hash && ngx_memcmp(slot->addr, key, 16) == 0) {
+            return slot;
+        }
+
+        if (*victim == NULL
+            || ((*victim)->hash != 0
+                && (slot->hash == 0
+                    || (ngx_msec_int_t) (slot->access - (*victim)->access)
+                       < 0)))
+        {
+            *victim = slot;
+        }
+
+        if (++n == nslots) {
+            n = 0;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Tests the tags of the key's cold window, kept in the zone: a key whose
+ * tag is not there is not in the file, and the file is not read.
+ */
+
+static ngx_uint_t
+ngx_http_block_legacy_spill_maybe(ngx_http_block_legacy_ctx_t *ctx,
+    uint32_t hash)
+{
+    u_char tag, *tags;
+    ngx_uint_t i, n;
+
+    tags = ctx->sh->spill_tags;
+    tag = ngx_http_block_legacy_tag(hash);
+    n = hash % ctx->spill_nslots;
+
+    for (i = 0; i < NGX_HTTP_BLOCK_LEGACY_PROBES; i++) {
+
+        if (tags[n] == tag) {
+            return 1;
+        }
+
+        if (++n == ctx->spill_nslots) {
+            n = 0;
+        }
+    }
+
+    return 0;
+}
+
+/* moves an evicted hot slot to the cold table, which drops its own LRU */
+
+static void
+ngx_http_block_legacy_demote(ngx_http_block_legacy_ctx_t *ctx,
+    ngx_http_block_legacy_slot_t *slot)
+{
+    ngx_http_block_legacy_slot_t *cold, *victim;
+
+    if (slot->hash == 0) {
+        return;
+    }
+
+    cold = ngx_http_block_legacy_find(ctx->spill_slots, ctx->spill_nslots,
+                                      slot->addr, slot->hash, &victim);
+    if (cold == NULL) {
+        cold = victim;
+    }
+
+    *cold = *slot;
+    ctx->sh->spill_tags[cold - ctx->spill_slots] =
+                                        ngx_http_block_legacy_tag(slot->hash);
+
+    (void) ngx_atomic_fetch_add(&ctx->sh->demoted, 1);
+}
+
+/*
+ * Maps the spill file shared, before the workers are forked.  The mapping
+ * and its entries are kept across reloads.  Otherwise the file is
+ * truncated, since the timestamps in it would be meaningless; a file that
+ * is still open in another generation of workers or another nginx is left
+ * alone.
+ */
+
+static ngx_int_t
+ngx_http_block_legacy_init_spill(ngx_shm_zone_t *shm_zone,
+    ngx_http_block_legacy_ctx_t *ctx, ngx_http_block_legacy_ctx_t *octx)
+{
+    u_char *p;
+    ssize_t n;
+    uint32_t magic;
+    ngx_fd_t fd;
+    ngx_err_t err;
+    ngx_http_block_legacy_spill_t *spill;
+    ngx_http_block_legacy_spill_map_t *map;
+
+    if (octx && octx->spill) {
+        ctx->spill = octx->spill;
+        ctx->spill_slots = octx->spill_slots;
+        ctx->spill->refs++;
+
+        return NGX_OK;
+    }
+
+    /* configuration testing must not touch the file of running workers */
+
+    if (ctx->spill_size == 0 || ngx_test_config) {
+        return NGX_OK;
+    }
+
+    fd = ngx_open_file(ctx->spill_path.data, NGX_FILE_RDWR,
+                       NGX_FILE_CREATE_OR_OPEN, NGX_FILE_DEFAULT_ACCESS);
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, ngx_errno,
+                      ngx_open_file_n " \"%V\" failed", &ctx->spill_path);
+        return NGX_ERROR;
+    }
+
+    if (flock(fd, LOCK_EX|LOCK_NB) == -1) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, ngx_errno,
+                      "spill file \"%V\" is in use, possibly by "
+                      "the workers of a previous configuration",
+                      &ctx->spill_path);
+        goto failed;
+    }
+
+    /* an existing file is only overwritten if it is a spill file */
+
+    n = ngx_read_fd(fd, &magic, sizeof(uint32_t));
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, ngx_errno,
+                      ngx_read_fd_n " \"%V\" failed", &ctx->spill_path);
+        goto failed;
+    }
+
+    if (n != 0
+        && (n != sizeof(uint32_t)
+            || magic != NGX_HTTP_BLOCK_LEGACY_SPILL_MAGIC))
+    {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                      "\"%V\" is not a spill file", &ctx->spill_path);
+        goto failed;
+    }
+
+    if (ftruncate(fd, 0) == -1
+        || ftruncate(fd, (off_t) ctx->spill_size) == -1)
+    {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, ngx_errno,
+                      "ftruncate(\"%V\", %uz) failed",
+                      &ctx->spill_path, ctx->spill_size);
+        goto failed;
+    }
+
+    /*
+     * allocate all blocks now: a write to a hole of a sparse file would
+     * allocate one under the zone lock, or raise SIGBUS on a full disk
+     */
+
+    err = posix_fallocate(fd, 0, (off_t) ctx->spill_size);
+
+    if (err != 0) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, err,
+                      "posix_fallocate(\"%V\", %uz) failed",
+                      &ctx->spill_path, ctx->spill_size);
+        goto failed;
+    }
+
+    p = mmap(NULL, ctx->spill_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (p == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, ngx_errno,
+                      "mmap(\"%V\", %uz) failed",
+                      &ctx->spill_path, ctx->spill_size);
+        goto failed;
+    }
+
+    map = ngx_alloc(sizeof(ngx_http_block_legacy_spill_map_t),
+                    shm_zone->shm.log);
+    if (map == NULL) {
+        (void) munmap(p, ctx->spill_size);
+        goto failed;
+    }
+
+    spill = (ngx_http_block_legacy_spill_t *) p;
+    spill->magic = NGX_HTTP_BLOCK_LEGACY_SPILL_MAGIC;
+
+    map->spill = spill;
+    map->size = ctx->spill_size;
+    map->fd = fd;
+    map->refs = 1;
+
+    ctx->spill = map;
+    ctx->spill_slots = (ngx_http_block_legacy_slot_t *) (spill + 1);
+
+    ngx_http_block_legacy_spill_populate(map);
+
+    return NGX_OK;
+
+failed:
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, shm_zone->shm.log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &ctx->spill_path);
+    }
+
+    return NGX_ERROR;
+}
+
+/*
+ * Faults in every page of the file for writing, in the master so that the
+ * pages are in the page cache and again in each worker for its own page
+ * tables, so that lookups under the zone lock never wait on a page fault.
+ */
+
+static void
+ngx_http_block_legacy_spill_populate(ngx_http_block_legacy_spill_map_t *map)
+{
+    u_char *p, *last;
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise((void *) map->spill, map->size, MADV_POPULATE_WRITE) == 0) {
+        return;
+    }
+#endif
+
+    /* older kernels */
+
+    p = (u_char *) map->spill;
+    last = p + map->size;
+
+    for ( /* void */ ; p < last; p += ngx_pagesize) {
+        *(volatile u_char *) p = *p;
+    }
+}
+
+/*
+ * Runs when a configuration is released: in the master after a reload or
+ * a failed one, and in a worker when it exits.
+ */
+
+static void
+ngx_http_block_legacy_spill_cleanup(void *data)
+{
+    ngx_http_block_legacy_ctx_t *ctx = data;
+
+    ngx_http_block_legacy_spill_map_t *map;
+
+    map = ctx->spill;
+
+    if (map == NULL || --map->refs) {
+        return;
+    }
+
+    if (munmap((void *) map->spill, map->size) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "munmap(\"%V\") failed", &ctx->spill_path);
+    }
+
+    if (ngx_close_file(map->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &ctx->spill_path);
+    }
+
+    ngx_free(map);
+}
+
+static void
+ngx_http_block_legacy_classify(ngx_http_request_t *r, ngx_uint_t trace)
+{
+    ngx_http_block_legacy_main_conf_t *bmcf;
+    ngx_http_block_legacy_ctx_t *ctx;
+    ngx_http_block_legacy_slot_t *slot;
+    uint32_t hash;
+    u_char key[16];
+
+    bmcf = ngx_http_get_module_main_conf(r, ngx_http_block_legacy_module);
+
+    /* only the first request on a connection marks the client */
+
+    if (bmcf->conn_rate == 0
+        || r != r->main
+        || r->connection->requests > 1
+        || ngx_http_block_legacy_is_probe(bmcf, r->connection->sockaddr))
+    {
+        return;
+    }
+
+    hash = ngx_http_block_legacy_key(r->connection->sockaddr, key);
+    if (hash == 0) {
+        return;
+    }
+
+    ctx = bmcf->shm_zone->data;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    slot = ngx_http_block_legacy_lookup(ctx, key, hash, 1);
+    slot->flags |= NGX_HTTP_BLOCK_LEGACY_LEGACY;
+    slot->legacy = ngx_current_msec;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    if (trace) {
+        ngx_http_block_legacy_trace(r, "client classified as legacy for "
+                                    "connection rate limiting");
+    }
+}
+
+static void
+ngx_http_block_legacy_init_connection(ngx_connection_t *c)
+{
+    ngx_http_block_legacy_main_conf_t *bmcf;
+
+    bmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_block_legacy_module);
+
+    if (bmcf->reclaim
+        && ngx_cycle->free_connection_n
+           < ngx_cycle->connection_n / NGX_HTTP_BLOCK_LEGACY_RECLAIM_SHARE)
+    {
+        ngx_http_block_legacy_reclaim(bmcf);
+    }
+
+    if (bmcf->conn_rate == 0) {
+        ngx_http_init_connection(c);
+        return;
+    }
+
+    if (!bmcf->accept_batch) {
+        ngx_http_block_legacy_conn_limit(&c, 1, bmcf);
+        return;
+    }
+
+    /*
+     * with multi_accept a worker accepts many connections in one pass,
+     * they are checked together once the accept handler returns
+     */
+
+    if (bmcf->nbatch == NGX_HTTP_BLOCK_LEGACY_BATCH) {
+        ngx_http_block_legacy_conn_limit(bmcf->batch, bmcf->nbatch, bmcf);
+        bmcf->nbatch = 0;
+    }
+
+    bmcf->batch[bmcf->nbatch++] = c;
+
+    if (!bmcf->batch_event.posted) {
+        ngx_post_event(&bmcf->batch_event, &ngx_posted_events);
+    }
+}
+
+static void
+ngx_http_block_legacy_batch_handler(ngx_event_t *ev)
+{
+    ngx_uint_t n;
+    ngx_http_block_legacy_main_conf_t *bmcf = ev->data;
+
+    n = bmcf->nbatch;
+    bmcf->nbatch = 0;
+
+    ngx_http_block_legacy_conn_limit(bmcf->batch, n, bmcf);
+}
+
+static void
+ngx_http_block_legacy_conn_limit(ngx_connection_t **cs, ngx_uint_t n,
+    ngx_http_block_legacy_main_conf_t *bmcf)
+{
+    ngx_uint_t i, k;
+    ngx_int_t rc[NGX_HTTP_BLOCK_LEGACY_BATCH];
+    uint32_t hash[NGX_HTTP_BLOCK_LEGACY_BATCH];
+    u_char key[NGX_HTTP_BLOCK_LEGACY_BATCH][16];
+    ngx_connection_t *c;
+    ngx_http_block_legacy_ctx_t *ctx;
+
+    ctx = bmcf->shm_zone->data;
+
+    /* hash all addresses and start loading their probe windows */
+
+    for (i = 0; i < n; i++) {
+        hash[i] = ngx_http_block_legacy_key(cs[i]->sockaddr, key[i]);
+
+        if (hash[i] == 0) {
+            continue;
+        }
+
+        k = hash[i] % ctx->sh->nslots;
+
+        ngx_http_block_legacy_prefetch_window(ctx->sh, k);
+    }
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    for (i = 0; i < n; i++) {
+        rc[i] = hash[i] ? ngx_http_block_legacy_conn_check(ctx, bmcf, key[i],
+                                                           hash[i])
+                        : NGX_OK;
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    for (i = 0; i < n; i++) {
+        c = cs[i];
+
+        if (rc[i] == NGX_OK
+            || ngx_http_block_legacy_is_probe(bmcf, c->sockaddr))
+        {
+            ngx_http_init_connection(c);
+            continue;
+        }
+
+        (void) ngx_atomic_fetch_add(&ctx->sh->conn_rejected, 1);
+
+        if (ngx_http_block_legacy_listening_ssl(c->listening)) {
+            (void) ngx_atomic_fetch_add(&ctx->sh->handshakes_avoided, 1);
+        }
+
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "legacy client %V exceeded connection rate, "
+                      "closing connection", &c->addr_text);
+
+        ngx_http_close_connection(c);
+    }
+}
+
+/*
+ * A probe window spans several cache lines, all of which the lookup may
+ * read; a window that runs past the end of the table continues at slot 0.
+ */
+
+static void
+ngx_http_block_legacy_prefetch_window(ngx_http_block_legacy_shctx_t *sh,
+    ngx_uint_t k)
+{
+    u_char *p, *last;
+    ngx_uint_t n;
+
+    n = ngx_min(NGX_HTTP_BLOCK_LEGACY_PROBES, sh->nslots - k);
+
+    p = (u_char *) ((uintptr_t) &sh->slots[k]
+                    & ~((uintptr_t) NGX_CPU_CACHE_LINE - 1));
+    last = (u_char *) &sh->slots[k + n];
+
+    for ( /* void */ ; p < last; p += NGX_CPU_CACHE_LINE) {
+        ngx_http_block_legacy_prefetch(p);
+    }
+
+    if (n == NGX_HTTP_BLOCK_LEGACY_PROBES) {
+        return;
+    }
+
+    p = (u_char *) ((uintptr_t) &sh->slots[0]
+                    & ~((uintptr_t) NGX_CPU_CACHE_LINE - 1));
+    last = (u_char *) &sh->slots[NGX_HTTP_BLOCK_LEGACY_PROBES - n];
+
+    for ( /* void */ ; p < last; p += NGX_CPU_CACHE_LINE) {
+        ngx_http_block_legacy_prefetch(p);
+    }
+}
+
+/* the zone mutex must be held */
+
+static ngx_int_t
+ngx_http_block_legacy_conn_check(ngx_http_block_legacy_ctx_t *ctx,
+    ngx_http_block_legacy_main_conf_t *bmcf, u_char *key, uint32_t hash)
+{
+    ngx_http_block_legacy_slot_t *slot;
+    ngx_msec_int_t ms;
+    ngx_int_t excess;
+
+    slot = ngx_http_block_legacy_lookup(ctx, key, hash, 0);
+
+    if (slot == NULL
+        || !(slot->flags & NGX_HTTP_BLOCK_LEGACY_LEGACY)
+        || ngx_current_msec - slot->legacy > NGX_HTTP_BLOCK_LEGACY_TTL)
+    {
+        return NGX_OK;
+    }
+
+    /* the address also speaks HTTP/2+, e.g. several clients behind NAT */
+
+    if ((slot->flags & NGX_HTTP_BLOCK_LEGACY_MODERN)
+        && ngx_current_msec - slot->modern <= bmcf->h2_memory)
+    {
+        return NGX_OK;
+    }
+
+    /* leaky bucket over connection attempts, as in limit_req */
+
+    ms = (ngx_msec_int_t) (ngx_current_msec - slot->conn_last);
+
+    if (ms < -60000) {
+        ms = 1;
+
+    } else if (ms < 0) {
+        ms = 0;
+    }
+
+    excess = slot->conn_excess - (ngx_int_t) bmcf->conn_rate * ms / 1000
+             + 1000;
+
+    if (excess < 0) {
+        excess = 0;
+    }
+
+    if ((ngx_uint_t) excess > bmcf->conn_burst) {
+        return NGX_BUSY;
+    }
+
+    slot->conn_excess = excess;
+    slot->conn_last = ngx_current_msec;
+
+    return NGX_OK;
+}
+
+static ngx_uint_t
+ngx_http_block_legacy_listening_ssl(ngx_listening_t *ls)
+{
+#if (NGX_HTTP_SSL)
+    ngx_uint_t i;
+    ngx_http_port_t *port;
+    ngx_http_in_addr_t *addr;
+#if (NGX_HAVE_INET6)
+    ngx_http_in6_addr_t *addr6;
+#endif
+
+    port = ls->servers;
+
+    switch (ls->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        addr6 = port->addrs;
+
+        for (i = 0; i < port->naddrs; i++) {
+            if (addr6[i].conf.ssl) {
+                return 1;
+            }
+        }
+
+        break;
+#endif
+
+    default:
+        addr = port->addrs;
+
+        for (i = 0; i < port->naddrs; i++) {
+            if (addr[i].conf.ssl) {
+                return 1;
+            }
+        }
+
+        break;
+    }
+#endif
+
+    return 0;
+}
+
+static char *
+ngx_http_block_legacy_shutdown_close(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_block_legacy_main_conf_t *bmcf = conf;
+    ngx_str_t *value;
+    ngx_msec_t grace;
+
+    if (bmcf->shutdown_close != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[1].data, "immediate") == 0) {
+        bmcf->shutdown_close = 0;
+        return NGX_CONF_OK;
+    }
+
+    grace = ngx_parse_time(&value[1], 0);
+    if (grace == (ngx_msec_t) NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    bmcf->shutdown_close = grace;
+
+    return NGX_CONF_OK;
+}
+
+static void
+ngx_http_block_legacy_track(ngx_http_request_t *r)
+{
+    ngx_connection_t *c;
+    ngx_pool_cleanup_t *cln;
+    ngx_http_block_legacy_conn_t *lc;
+    ngx_http_block_legacy_main_conf_t *bmcf;
+
+    bmcf = ngx_http_get_module_main_conf(r, ngx_http_block_legacy_module);
+
+    if (!bmcf->registry || r != r->main) {
+        return;
+    }
+
+    c = r->connection;
+
+    lc = ngx_http_block_legacy_registered(c);
+
+    if (lc == NULL) {
+        cln = ngx_pool_cleanup_add(c->pool,
+                                   sizeof(ngx_http_block_legacy_conn_t));
+        if (cln == NULL) {
+            return;
+        }
+
+        lc = cln->data;
+        lc->connection = c;
+        lc->request = NULL;
+        ngx_queue_insert_tail(&bmcf->idle, &lc->queue);
+
+        cln->handler = ngx_http_block_legacy_conn_cleanup;
+    }
+
+    ngx_http_block_legacy_busy(bmcf, lc, r);
+}
+
+/*
+ * Runs for every request, so a registered connection leaves the idle
+ * queue as soon as its next request is read, whatever the location does
+ * with it.
+ */
+
+static ngx_int_t
+ngx_http_block_legacy_post_read(ngx_http_request_t *r)
+{
+    ngx_http_block_legacy_conn_t *lc;
+    ngx_http_block_legacy_main_conf_t *bmcf;
+
+    if (r != r->main || r->http_version >= NGX_HTTP_VERSION_20) {
+        return NGX_DECLINED;
+    }
+
+    lc = ngx_http_block_legacy_registered(r->connection);
+
+    if (lc != NULL) {
+        bmcf = ngx_http_get_module_main_conf(r, ngx_http_block_legacy_module);
+        ngx_http_block_legacy_busy(bmcf, lc, r);
+    }
+
+    return NGX_DECLINED;
+}
+
+static ngx_http_block_legacy_conn_t *
+ngx_http_block_legacy_registered(ngx_connection_t *c)
+{
+    ngx_pool_cleanup_t *cln;
+
+    for (cln = c->pool->cleanup; cln; cln = cln->next) {
+        if (cln->handler == ngx_http_block_legacy_conn_cleanup) {
+            return cln->data;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+ngx_http_block_legacy_busy(ngx_http_block_legacy_main_conf_t *bmcf,
+    ngx_http_block_legacy_conn_t *lc, ngx_http_request_t *r)
+{
+    ngx_pool_cleanup_t *cln;
+
+    if (lc->request == r) {
+        return;
+    }
+
+    /* the request cleanup moves the connection back to the idle queue */
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return;
+    }
+
+    lc->request = r;
+
+    ngx_queue_remove(&lc->queue);
+    ngx_queue_insert_tail(&bmcf->connections, &lc->queue);
+
+    cln->handler = ngx_http_block_legacy_request_cleanup;
+    cln->data = lc;
+}
+
+static void
+ngx_http_block_legacy_conn_cleanup(void *data)
+{
+    ngx_http_block_legacy_conn_t *lc = data;
+
+    ngx_queue_remove(&lc->queue);
+}
+
+static void
+ngx_http_block_legacy_request_cleanup(void *data)
+{
+    ngx_http_block_legacy_conn_t *lc = data;
+    ngx_http_block_legacy_main_conf_t *bmcf;
+
+    bmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_block_legacy_module);
+
+    lc->request = NULL;
+
+    /* most recently used connections are kept at the tail */
+
+    ngx_queue_remove(&lc->queue);
+    ngx_queue_insert_tail(&bmcf->idle, &lc->queue);
+}
+
+static void
+ngx_http_block_legacy_exit_handler(ngx_event_t *ev)
+{
+    ngx_http_block_legacy_main_conf_t *bmcf = ev->data;
+
+    if (!ngx_exiting) {
+        ngx_add_timer(ev, NGX_HTTP_BLOCK_LEGACY_EXIT_POLL);
+        return;
+    }
+
+    if (!bmcf->exiting && bmcf->shutdown_close > 0) {
+        bmcf->exiting = 1;
+        ngx_add_timer(ev, bmcf->shutdown_close);
+        return;
+    }
+
+    ngx_http_block_legacy_close_idle(bmcf);
+}
+
+static void
+ngx_http_block_legacy_close_idle(ngx_http_block_legacy_main_conf_t *bmcf)
+{
+    ngx_uint_t n;
+    ngx_queue_t *q, *next;
+    ngx_connection_t *c;
+    ngx_http_request_t *r;
+    ngx_http_block_legacy_ctx_t *ctx;
+    ngx_http_block_legacy_conn_t *lc;
+
+    n = 0;
+
+    /*
+     * no request is in progress; idle keepalive connections were already
+     * closed by ngx_close_idle_connections(), so these are reading the next
+     * request or in lingering close after a request that was rejected
+     * while its header was read, and every such read handler closes the
+     * connection on timeout (logged as a timeout); one that is still
+     * sending such an error response is left open
+     */
+
+    for (q = ngx_queue_head(&bmcf->idle);
+         q != ngx_queue_sentinel(&bmcf->idle);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        lc = ngx_queue_data(q, ngx_http_block_legacy_conn_t, queue);
+        c = lc->connection;
+
+        c->read->timedout = 1;
+        c->read->handler(c->read);
+
+        /* a closed connection has been removed by its pool cleanup */
+
+        if (ngx_queue_prev(next) != q) {
+            n++;
+
+        } else {
+            c->read->timedout = 0;
+        }
+    }
+
+    /*
+     * of the connections with a request in progress, only close those
+     * whose response is done and that wait for the client: lingering close
+     * or discarding the request body, the only two states that set
+     * r->lingering_time; both read handlers close on timeout, and the rest
+     * are left to finish, keepalive is off while exiting
+     */
+
+    for (q = ngx_queue_head(&bmcf->connections);
+         q != ngx_queue_sentinel(&bmcf->connections);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        lc = ngx_queue_data(q, ngx_http_block_legacy_conn_t, queue);
+        r = lc->request;
+
+        if (r->lingering_time == 0) {
+            continue;
+        }
+
+        c = lc->connection;
+
+        c->read->timedout = 1;
+        c->read->handler(c->read);
+
+        if (ngx_queue_prev(next) != q) {
+            n++;
+
+        } else {
+            c->read->timedout = 0;
+        }
+    }
+
+    if (n == 0) {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "closed %ui legacy connections on exit", n);
+
+    if (bmcf->shm_zone) {
+        ctx = bmcf->shm_zone->data;
+        (void) ngx_atomic_fetch_add(&ctx->sh->shutdown_closed, n);
+    }
+}
+
+static void
+ngx_http_block_legacy_reclaim(ngx_http_block_legacy_main_conf_t *bmcf)
+{
+    ngx_uint_t n, scanned;
+    ngx_queue_t *q, *next;
+    ngx_connection_t *c;
+    ngx_http_block_legacy_ctx_t *ctx;
+    ngx_http_block_legacy_conn_t *lc;
+
+    /*
+     * close idle legacy connections, least recently used first, before
+     * ngx_drain_connections() gets to evict idle HTTP/2 connections;
+     * connections between requests that are not idle (reading the next
+     * request or in lingering close) are skipped, and bound the scan
+     */
+
+    n = 0;
+    scanned = 0;
+
+    for (q = ngx_queue_head(&bmcf->idle);
+         q != ngx_queue_sentinel(&bmcf->idle)
+         && n < NGX_HTTP_BLOCK_LEGACY_RECLAIM
+         && scanned++ < 4 * NGX_HTTP_BLOCK_LEGACY_RECLAIM;
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        lc = ngx_queue_data(q, ngx_http_block_legacy_conn_t, queue);
+        c = lc->connection;
+
+        if (!c->idle) {
+            continue;
+        }
+
+        c->close = 1;
+        c->read->handler(c->read);
+
+        n++;
+    }
+
+    if (n == 0) {
+        return;
+    }
+
+    /* at most once a second, as for connections_reuse_time in core */
+
+    if (bmcf->reclaim_time != ngx_time()) {
+        bmcf->reclaim_time = ngx_time();
+
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "%ui worker_connections are not enough, "
+                      "reclaiming idle legacy connections",
+                      ngx_cycle->connection_n);
+    }
+
+    if (bmcf->shm_zone) {
+        ctx = bmcf->shm_zone->data;
+        (void) ngx_atomic_fetch_add(&ctx->sh->reclaimed, n);
+    }
+}
+
+static char *
+ngx_http_block_legacy_probe(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_block_legacy_main_conf_t *bmcf = conf;
+    ngx_str_t *value, s;
+    ngx_url_t u;
+    ngx_http_block_legacy_probe_t *probe;
+
+    if (bmcf->probe) {
+        return "is duplicate";
+    }
+
+    probe = ngx_pcalloc(cf->pool, sizeof(ngx_http_block_legacy_probe_t));
+    if (probe == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = value[1];
+    u.default_port = 80;
+    u.no_resolve = 1;
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        if (u.err) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "%s in \"%V\"", u.err, &u.url);
+        }
+
+        return NGX_CONF_ERROR;
+    }
+
+    if (u.naddrs == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no address in \"%V\"", &u.url);
+        return NGX_CONF_ERROR;
+    }
+
+    if (value[2].len == 0 || value[2].data[0] != '/') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid probe uri \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    probe->addr = &u.addrs[0];
+    probe->interval = NGX_HTTP_BLOCK_LEGACY_PROBE_INTERVAL;
+
+    if (cf->args->nelts == 4) {
+        if (ngx_strncmp(value[3].data, "interval=", 9) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[3]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.data = value[3].data + 9;
+        s.len = value[3].len - 9;
+
+        probe->interval = ngx_parse_time(&s, 0);
+        if (probe->interval == (ngx_msec_t) NGX_ERROR
+            || probe->interval == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid interval \"%V\"", &value[3]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    probe->request.len = sizeof("GET  HTTP/1.0" CRLF
+                                "Host: localhost" CRLF
+                                "User-Agent: block_legacy probe" CRLF CRLF)
+                         - 1 + value[2].len;
+
+    probe->request.data = ngx_pnalloc(cf->pool, probe->request.len);
+    if (probe->request.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_sprintf(probe->request.data, "GET %V HTTP/1.0" CRLF
+                "Host: localhost" CRLF
+                "User-Agent: block_legacy probe" CRLF CRLF, &value[2]);
+
+    bmcf->probe = probe;
+
+    return NGX_CONF_OK;
+}
+
+static void
+ngx_http_block_legacy_probe_start(ngx_event_t *ev)
+{
+    ngx_int_t rc;
+    struct timeval tv;
+    ngx_connection_t *c;
+    ngx_http_block_legacy_probe_t *probe = ev->data;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_memzero(&probe->peer, sizeof(ngx_peer_connection_t));
+
+    probe->peer.sockaddr = probe->addr->sockaddr;
+    probe->peer.socklen = probe->addr->socklen;
+    probe->peer.name = &probe->addr->name;
+    probe->peer.log = ev->log;
+    probe->peer.log_error = NGX_ERROR_ERR;
+
+    ngx_gettimeofday(&tv);
+    probe->start = (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+
+    rc = ngx_http_block_legacy_probe_connect(&probe->peer);
+
+    if (rc == NGX_ERROR) {
+        ngx_http_block_legacy_probe_done(probe, 0);
+        return;
+    }
+
+    c = probe->peer.connection;
+    c->data = probe;
+
+    c->read->handler = ngx_http_block_legacy_probe_read;
+    c->write->handler = ngx_http_block_legacy_probe_write;
+
+    probe->sent = probe->request.data;
+    probe->len = 0;
+
+    ngx_add_timer(c->read, NGX_HTTP_BLOCK_LEGACY_PROBE_TIMEOUT);
+
+    if (rc == NGX_OK) {
+        ngx_http_block_legacy_probe_write(c->write);
+    }
+}
+
+/*
+ * As ngx_event_connect_peer(), except that the socket is bound before
+ * connect(): its local address is published as soon as it is known, so
+ * it is in the zone before the listener can accept the connection, even
+ * over loopback where the accepting worker may run first.
+ */
+
+static ngx_int_t
+ngx_http_block_legacy_probe_connect(ngx_peer_connection_t *pc)
+{
+    int rc, type;
+    ngx_err_t err;
+    ngx_socket_t s;
+    socklen_t len;
+    ngx_sockaddr_t sa;
+    ngx_event_t *rev, *wev;
+    ngx_connection_t *c;
+
+    if (pc->sockaddr->sa_family != AF_UNIX
+        && ngx_http_block_legacy_probe_source(pc, &sa, &len) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    s = ngx_socket(pc->sockaddr->sa_family, SOCK_STREAM, 0);
+
+    if (s == (ngx_socket_t) -1) {
+        ngx_log_error(NGX_LOG_ALERT, pc->log, ngx_socket_errno,
+                      ngx_socket_n " failed");
+        return NGX_ERROR;
+    }
+
+    c = ngx_get_connection(s, pc->log);
+
+    if (c == NULL) {
+        if (ngx_close_socket(s) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, pc->log, ngx_socket_errno,
+                          ngx_close_socket_n " failed");
+        }
+
+        return NGX_ERROR;
+    }
+
+    c->type = SOCK_STREAM;
+    pc->connection = c;
+
+    if (ngx_nonblocking(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, pc->log, ngx_socket_errno,
+                      ngx_nonblocking_n " failed");
+        goto failed;
+    }
+
+    if (pc->sockaddr->sa_family != AF_UNIX) {
+        if (bind(s, &sa.sockaddr, len) == -1) {
+            ngx_log_error(NGX_LOG_CRIT, pc->log, ngx_socket_errno,
+                          "bind() of probe socket failed");
+            goto failed;
+        }
+
+        /* the port is assigned by bind(), publish before connect() */
+
+        ngx_http_block_legacy_probe_peer(c, 1);
+    }
+
+    c->recv = ngx_recv;
+    c->send = ngx_send;
+    c->recv_chain = ngx_recv_chain;
+    c->send_chain = ngx_send_chain;
+
+    c->log_error = pc->log_error;
+
+    rev = c->read;
+    wev = c->write;
+
+    rev->log = pc->log;
+    wev->log = pc->log;
+
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+    if (ngx_add_conn) {
+        if (ngx_add_conn(c) == NGX_ERROR) {
+            goto failed;
+        }
+    }
+
+    rc = connect(s, pc->sockaddr, pc->socklen);
+
+    if (rc == -1) {
+        err = ngx_socket_errno;
+
+        if (err != NGX_EINPROGRESS) {
+            ngx_log_error(NGX_LOG_ERR, pc->log, err,
+                          "connect() to %V failed", pc->name);
+            goto failed;
+        }
+    }
+
+    if (ngx_add_conn) {
+        if (rc == -1) {
+            return NGX_AGAIN;
+        }
+
+        wev->ready = 1;
+
+        return NGX_OK;
+    }
+
+    type = (ngx_event_flags & NGX_USE_CLEAR_EVENT) ? NGX_CLEAR_EVENT
+                                                   : NGX_LEVEL_EVENT;
+
+    if (ngx_add_event(rev, NGX_READ_EVENT, type) != NGX_OK) {
+        goto failed;
+    }
+
+    if (rc == -1) {
+        if (ngx_add_event(wev, NGX_WRITE_EVENT, type) != NGX_OK) {
+            goto failed;
+        }
+
+        return NGX_AGAIN;
+    }
+
+    wev->ready = 1;
+
+    return NGX_OK;
+
+failed:
+
+    ngx_http_block_legacy_probe_peer(c, 0);
+    ngx_close_connection(c);
+    pc->connection = NULL;
+
+    return NGX_ERROR;
+}
+
+/*
+ * The local address the kernel routes to the probe target from, with
+ * port 0: connect() on a datagram socket only selects the route.
+ */
+
+static ngx_int_t
+ngx_http_block_legacy_probe_source(ngx_peer_connection_t *pc,
+    ngx_sockaddr_t *sa, socklen_t *len)
+{
+    ngx_int_t rc;
+    ngx_socket_t s;
+
+    s = ngx_socket(pc->sockaddr->sa_family, SOCK_DGRAM, 0);
+
+    if (s == (ngx_socket_t) -1) {
+        ngx_log_error(NGX_LOG_ALERT, pc->log, ngx_socket_errno,
+                      ngx_socket_n " failed");
+        return NGX_ERROR;
+    }
+
+    rc = NGX_OK;
+    *len = sizeof(ngx_sockaddr_t);
+
+    if (connect(s, pc->sockaddr, pc->socklen) == -1
+        || getsockname(s, &sa->sockaddr, len) == -1)
+    {
+        ngx_log_error(NGX_LOG_ERR, pc->log, ngx_socket_errno,
+                      "no local address for probe of %V", pc->name);
+        rc = NGX_ERROR;
+
+    } else {
+        ngx_inet_set_port(&sa->sockaddr, 0);
+    }
+
+    if (ngx_close_socket(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, pc->log, ngx_socket_errno,
+                      ngx_close_socket_n " failed");
+    }
+
+    return rc;
+}
+
+static void
+ngx_http_block_legacy_probe_write(ngx_event_t *wev)
+{
+    ssize_t n;
+    u_char *last;
+    ngx_connection_t *c;
+    ngx_http_block_legacy_probe_t *probe;
+
+    c = wev->data;
+    probe = c->data;
+
+    last = probe->request.data + probe->request.len;
+
+    while (probe->sent < last) {
+        n = c->send(c, probe->sent, last - probe->sent);
+
+        if (n == NGX_ERROR) {
+            ngx_http_block_legacy_probe_done(probe, 0);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_http_block_legacy_probe_done(probe, 0);
+            }
+
+            return;
+        }
+
+        probe->sent += n;
+    }
+
+    if (c->read->ready) {
+        ngx_http_block_legacy_probe_read(c->read);
+    }
+}
+
+static void
+ngx_http_block_legacy_probe_read(ngx_event_t *rev)
+{
+    ssize_t n;
+    ngx_connection_t *c;
+    ngx_http_block_legacy_probe_t *probe;
+
+    c = rev->data;
+    probe = c->data;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_WARN, rev->log, NGX_ETIMEDOUT,
+                      "block_legacy probe timed out");
+        ngx_http_block_legacy_probe_done(probe, 0);
+        return;
+    }
+
+    for ( ;; ) {
+        n = c->recv(c, probe->buf + probe->len,
+                    sizeof(probe->buf) - probe->len);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_http_block_legacy_probe_done(probe, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_http_block_legacy_probe_done(probe, 0);
+            return;
+        }
+
+        probe->len += n;
+
+        if (probe->len == sizeof(probe->buf)) {
+            break;
+        }
+    }
+
+    /* only the status line matters: "HTTP/1.x 426" */
+
+    ngx_http_block_legacy_probe_done(probe,
+                     ngx_strncmp(probe->buf, "HTTP/1.", 7) == 0
+                     && ngx_strncmp(probe->buf + 8, " 426", 4) == 0);
+}
+
+static void
+ngx_http_block_legacy_probe_done(ngx_http_block_legacy_probe_t *probe,
+    ngx_uint_t ok)
+{
+    ngx_uint_t i;
+    uint64_t us;
+    struct timeval tv;
+    ngx_http_block_legacy_ctx_t *ctx;
+    ngx_http_block_legacy_main_conf_t *bmcf;
+
+    if (probe->peer.connection) {
+        ngx_http_block_legacy_probe_peer(probe->peer.connection, 0);
+        ngx_close_connection(probe->peer.connection);
+        probe->peer.connection = NULL;
+    }
+
+    bmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_block_legacy_module);
+    ctx = bmcf->shm_zone->data;
+
+    if (ok) {
+        ngx_gettimeofday(&tv);
+        us = (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec - probe->start;
+
+        for (i = 0; i < NGX_HTTP_BLOCK_LEGACY_BUCKETS - 1; i++) {
+            if (us < (2ULL << i)) {
+                break;
+            }
+        }
+
+        (void) ngx_atomic_fetch_add(&ctx->sh->probe_latency[i], 1);
+        (void) ngx_atomic_fetch_add(&ctx->sh->probe_ok, 1);
+
+    } else {
+        ngx_log_error(NGX_LOG_WARN, probe->event.log, 0,
+                      "block_legacy probe of %V did not get "
+                      "426 Upgrade Required", &probe->addr->name);
+
+        (void) ngx_atomic_fetch_add(&ctx->sh->probe_failed, 1);
+    }
+
+    if (!ngx_exiting) {
+        ngx_add_timer(&probe->event, probe->interval);
+    }
+}
+
+/*
+ * Publishes the local address of a probe connection, so that whichever
+ * worker accepts it can recognize it: probes are neither classified nor
+ * limited, and their expected 426 is not logged.  It is called after
+ * bind() and before connect(), so the address is always published first.
+ */
+
+static void
+ngx_http_block_legacy_probe_peer(ngx_connection_t *c, ngx_uint_t running)
+{
+    socklen_t len;
+    ngx_sockaddr_t sa;
+    ngx_http_block_legacy_ctx_t *ctx;
+    ngx_http_block_legacy_main_conf_t *bmcf;
+    ngx_http_block_legacy_probe_peer_t *peer;
+
+    bmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_block_legacy_module);
+    ctx = bmcf->shm_zone->data;
+
+    peer = &ctx->sh->probe_peers[ngx_worker
+                                 % NGX_HTTP_BLOCK_LEGACY_PROBE_PEERS];
+
+    if (!running) {
+        peer->port = 0;
+        return;
+    }
+
+    /* the connection has no pool for ngx_connection_local_sockaddr() */
+
+    len = sizeof(ngx_sockaddr_t);
+
+    if (getsockname(c->fd, &sa.sockaddr, &len) == -1
+        || ngx_http_block_legacy_key(&sa.sockaddr, peer->addr) == 0)
+    {
+        peer->port = 0;
+        return;
+    }
+
+    peer->port = ngx_inet_get_port(&sa.sockaddr);
+}
+
+static ngx_uint_t
+ngx_http_block_legacy_is_probe(ngx_http_block_legacy_main_conf_t *bmcf,
+    struct sockaddr *sa)
+{
+    ngx_uint_t i;
+    in_port_t port;
+    u_char key[16];
+    ngx_http_block_legacy_ctx_t *ctx;
+    ngx_http_block_legacy_probe_peer_t *peer;
+
+    if (bmcf->probe == NULL
+        || ngx_http_block_legacy_key(sa, key) == 0)
+    {
+        return 0;
+    }
+
+    port = ngx_inet_get_port(sa);
+    ctx = bmcf->shm_zone->data;
+    peer = ctx->sh->probe_peers;
+
+    for (i = 0; i < NGX_HTTP_BLOCK_LEGACY_PROBE_PEERS; i++) {
+        if (peer[i].port == port && ngx_memcmp(peer[i].addr, key, 16) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static ngx_int_t
+ngx_http_block_legacy_histogram_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_uint_t i;
+    ngx_atomic_t *bucket;
+    ngx_http_block_legacy_ctx_t *ctx;
+    ngx_http_block_legacy_main_conf_t *bmcf;
+    u_char *p;
+
+    bmcf = ngx_http_get_module_main_conf(r, ngx_http_block_legacy_module);
+
+    if (bmcf->shm_zone == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    ctx = bmcf->shm_zone->data;
+    bucket = (ngx_atomic_t *) ((u_char *) ctx->sh + data);
+
+    /* "2:N 4:N ... inf:N", bucket upper bounds in microseconds */
+
+    p = ngx_pnalloc(r->pool, NGX_HTTP_BLOCK_LEGACY_BUCKETS
+                             * (NGX_INT_T_LEN + 1 + NGX_ATOMIC_T_LEN + 1));
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->data = p;
+
+    for (i = 0; i < NGX_HTTP_BLOCK_LEGACY_BUCKETS - 1; i++) {
+        p = ngx_sprintf(p, "%uL:%uA ", 2ULL << i, bucket[i]);
+    }
+
+    p = ngx_sprintf(p, "inf:%uA", bucket[i]);
+
+    v->len = p - v->data;
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_block_legacy_counter_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_block_legacy_main_conf_t *bmcf;
+    ngx_http_block_legacy_ctx_t *ctx;
+    ngx_atomic_t *counter;
+    u_char *p;
+
+    bmcf = ngx_http_get_module_main_conf(r, ngx_http_block_legacy_module);
+
+    if (bmcf->shm_zone == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    ctx = bmcf->shm_zone->data;
+    counter = (ngx_atomic_t *) ((u_char *) ctx->sh + data);
+
+    p = ngx_pnalloc(r->pool, NGX_ATOMIC_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%uA", *counter) - p;
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_block_legacy_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t *var, *v;
+
+    for (v = ngx_http_block_legacy_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_block_legacy_init(ngx_conf_t *cf)
+{
+    ngx_http_handler_pt        *h;
+    ngx_http_core_main_conf_t  *cmcf;
+    ngx_http_block_legacy_main_conf_t *bmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_REWRITE_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_block_legacy_handler;
+
+    bmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_block_legacy_module);
+
+    if (bmcf->registry) {
+        h = ngx_array_push(&cmcf->phases[NGX_HTTP_POST_READ_PHASE].handlers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        *h = ngx_http_block_legacy_post_read;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_block_legacy_init_module(ngx_cycle_t *cycle)
+{
+    ngx_uint_t i;
+    ngx_listening_t *ls;
+    ngx_http_block_legacy_main_conf_t *bmcf;
+
+    bmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_block_legacy_module);
+
+    if (bmcf == NULL || (bmcf->conn_rate == 0 && !bmcf->reclaim)) {
+        return NGX_OK;
+    }
+
+    /*
+     * hook the connection init path of every TCP HTTP listener; QUIC
+     * listeners get a connection per datagram, not per client
+     */
+
+    ls = cycle->listening.elts;
+
+    for (i = 0; i < cycle->listening.nelts; i++) {
+
+#if (NGX_HTTP_V3)
+        if (ls[i].quic) {
+            continue;
+        }
+#endif
+
+        if (ls[i].handler == ngx_http_init_connection) {
+            ls[i].handler = ngx_http_block_legacy_init_connection;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_block_legacy_init_process(ngx_cycle_t *cycle)
+{
+    ngx_event_conf_t *ecf;
+    ngx_http_block_legacy_ctx_t *ctx;
+    ngx_http_block_legacy_main_conf_t *bmcf;
+
+    bmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_block_legacy_module);
+
+    if (bmcf == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_queue_init(&bmcf->connections);
+    ngx_queue_init(&bmcf->idle);
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    if (bmcf->shm_zone) {
+        ctx = bmcf->shm_zone->data;
+
+        if (ctx->spill) {
+            ngx_http_block_legacy_spill_populate(ctx->spill);
+        }
+    }
+
+    if (bmcf->trace) {
+        bmcf->traced = ngx_pcalloc(cycle->pool, cycle->connection_n
+                                   * sizeof(ngx_http_block_legacy_traced_t));
+        if (bmcf->traced == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    /* without multi_accept there is one connection per accept pass */
+
+    ecf = ngx_event_get_conf(cycle->conf_ctx, ngx_event_core_module);
+
+    if (!ecf->multi_accept) {
+        bmcf->accept_batch = 0;
+    }
+
+    bmcf->batch_event.handler = ngx_http_block_legacy_batch_handler;
+    bmcf->batch_event.data = bmcf;
+    bmcf->batch_event.log = cycle->log;
+
+    /* cancelable timers never keep an exiting worker alive */
+
+    if (bmcf->shutdown_close != NGX_CONF_UNSET_MSEC) {
+        bmcf->exit_event.handler = ngx_http_block_legacy_exit_handler;
+        bmcf->exit_event.data = bmcf;
+        bmcf->exit_event.log = cycle->log;
+        bmcf->exit_event.cancelable = 1;
+
+        ngx_add_timer(&bmcf->exit_event, NGX_HTTP_BLOCK_LEGACY_EXIT_POLL);
+    }
+
+    if (bmcf->probe) {
+        bmcf->probe->event.handler = ngx_http_block_legacy_probe_start;
+        bmcf->probe->event.data = bmcf->probe;
+        bmcf->probe->event.log = cycle->log;
+        bmcf->probe->event.cancelable = 1;
+
+        ngx_add_timer(&bmcf->probe->event, bmcf->probe->interval);
+    }
+
+    return NGX_OK;
+}
+
+static char *
+ngx_http_block_legacy_challenge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_block_legacy_main_conf_t *bmcf;
+
+    bmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_block_legacy_module);
+    bmcf->challenge = 1;
+
+    return ngx_conf_set_flag_slot(cf, cmd, conf);
+}
+
+/*
+ * Absorbs the HMAC key pads once, so that signing a cookie costs
+ * two SHA-1 compressions.  Without block_legacy_challenge_secret a random
+ * key is used, and cookies issued before a reload are no longer valid.
+ */
+
+static ngx_int_t
+ngx_http_block_legacy_challenge_key(ngx_conf_t *cf,
+    ngx_http_block_legacy_main_conf_t *bmcf)
+{
+    u_char *key;
+    size_t len;
+    ssize_t n;
+    ngx_fd_t fd;
+    ngx_uint_t i;
+    ngx_sha1_t sha1;
+    u_char digest[20], pad[64];
+
+    key = bmcf->challenge_secret.data;
+    len = bmcf->challenge_secret.len;
+
+    if (len == 0) {
+        fd = ngx_open_file((u_char *) "/dev/urandom", NGX_FILE_RDONLY,
+                           NGX_FILE_OPEN, 0);
+        if (fd == NGX_INVALID_FILE) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                               ngx_open_file_n " \"/dev/urandom\" failed");
+            return NGX_ERROR;
+        }
+
+        n = ngx_read_fd(fd, digest, 20);
+
+        if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+            ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno,
+                               ngx_close_file_n " \"/dev/urandom\" failed");
+        }
+
+        if (n != 20) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                               ngx_read_fd_n " \"/dev/urandom\" failed");
+            return NGX_ERROR;
+        }
+
+        key = digest;
+        len = 20;
+
+    } else if (len > 64) {
+        ngx_sha1_init(&sha1);
+        ngx_sha1_update(&sha1, key, len);
+        ngx_sha1_final(digest, &sha1);
+
+        key = digest;
+        len = 20;
+    }
+
+    for (i = 0; i < 64; i++) {
+        pad[i] = (u_char) ((i < len ? key[i] : 0) ^ 0x36);
+    }
+
+    ngx_sha1_init(&bmcf->challenge_inner);
+    ngx_sha1_update(&bmcf->challenge_inner, pad, 64);
+
+    for (i = 0; i < 64; i++) {
+        pad[i] ^= 0x36 ^ 0x5c;
+    }
+
+    ngx_sha1_init(&bmcf->challenge_outer);
+    ngx_sha1_update(&bmcf->challenge_outer, pad, 64);
+
+    return NGX_OK;
+}
+
+/* HMAC-SHA1 over the cookie expiry time and the client address */
+
+static void
+ngx_http_block_legacy_sign(ngx_http_block_legacy_main_conf_t *bmcf,
+    time_t expires, u_char *addr, u_char *mac)
+{
+    u_char *p;
+    ngx_sha1_t sha1;
+    u_char buf[NGX_TIME_T_LEN + 16];
+
+    p = ngx_sprintf(buf, "%T", expires);
+    p = ngx_cpymem(p, addr, 16);
+
+    sha1 = bmcf->challenge_inner;
+    ngx_sha1_update(&sha1, buf, p - buf);
+    ngx_sha1_final(mac, &sha1);
+
+    sha1 = bmcf->challenge_outer;
+    ngx_sha1_update(&sha1, mac, 20);
+    ngx_sha1_final(mac, &sha1);
+}
+
+/*
+ * Checks the "block_legacy=<expires>-<hex mac>" cookie.  Cookies verified
+ * by this worker are remembered, so a returning client costs a lookup
+ * instead of an HMAC.
+ */
+
+static ngx_int_t
+ngx_http_block_legacy_verify(ngx_http_request_t *r, ngx_uint_t trace)
+{
+    u_char *p, *last;
+    time_t expires;
+    ngx_int_t n;
+    ngx_uint_t i, diff;
+    ngx_str_t value;
+    u_char addr[16], mac[20], expect[20];
+    ngx_http_block_legacy_token_t *token;
+    ngx_http_block_legacy_main_conf_t *bmcf;
+
+    static ngx_str_t name = ngx_string(NGX_HTTP_BLOCK_LEGACY_COOKIE);
+
+#if (nginx_version >= 1023000)
+    if (ngx_http_parse_multi_header_lines(r, r->headers_in.cookie, &name,
+                                          &value)
+        == NULL)
+#else
+    if (ngx_http_parse_multi_header_lines(&r->headers_in.cookies, &name,
+                                          &value)
+        == NGX_DECLINED)
+#endif
+    {
+        return NGX_DECLINED;
+    }
+
+    last = value.data + value.len;
+    p = ngx_strlchr(value.data, last, '-');
+
+    if (p == NULL || last - p != 1 + 2 * 20) {
+        goto invalid;
+    }
+
+    expires = ngx_atotm(value.data, p - value.data);
+
+    if (expires == NGX_ERROR || expires < ngx_time()) {
+        goto invalid;
+    }
+
+    for (i = 0, p++; i < 20; i++, p += 2) {
+        n = ngx_hextoi(p, 2);
+        if (n == NGX_ERROR) {
+            goto invalid;
+        }
+
+        mac[i] = (u_char) n;
+    }
+
+    if (ngx_http_block_legacy_key(r->connection->sockaddr, addr) == 0) {
+        goto invalid;
+    }
+
+    bmcf = ngx_http_get_module_main_conf(r, ngx_http_block_legacy_module);
+
+    token = &bmcf->tokens[(mac[0] | mac[1] << 8)
+                          % NGX_HTTP_BLOCK_LEGACY_TOKENS];
+
+    if (token->expires == expires
+        && ngx_memcmp(token->mac, mac, 20) == 0
+        && ngx_memcmp(token->addr, addr, 16) == 0)
+    {
+        return NGX_OK;
+    }
+
+    ngx_http_block_legacy_sign(bmcf, expires, addr, expect);
+
+    for (i = 0, diff = 0; i < 20; i++) {
+        diff |= mac[i] ^ expect[i];
+    }
+
+    if (diff) {
+        goto invalid;
+    }
+
+    ngx_memcpy(token->mac, mac, 20);
+    ngx_memcpy(token->addr, addr, 16);
+    token->expires = expires;
+
+    return NGX_OK;
+
+invalid:
+
+    if (trace) {
+        ngx_http_block_legacy_trace(r, "invalid challenge cookie \"%V\"",
+                                    &value);
+    }
+
+    return NGX_DECLINED;
+}
+
+/* An empty 307 back to the same URI that sets the challenge cookie */
+
+static ngx_int_t
+ngx_http_block_legacy_send_challenge(ngx_http_request_t *r)
+{
+    u_char *p;
+    time_t expires;
+    ngx_int_t rc;
+    u_char addr[16], mac[20];
+    ngx_table_elt_t *h;
+    ngx_http_block_legacy_main_conf_t *bmcf;
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "HTTP/%ui.%ui request challenged, client: %V, "
+                  "request: \"%V\"",
+                  r->http_major, r->http_minor, &r->connection->addr_text,
+                  &r->request_line);
+
+    /* the client sends the body again after the redirect */
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (ngx_http_block_legacy_key(r->connection->sockaddr, addr) == 0) {
+        ngx_memzero(addr, 16);
+    }
+
+    bmcf = ngx_http_get_module_main_conf(r, ngx_http_block_legacy_module);
+
+    expires = ngx_time() + NGX_HTTP_BLOCK_LEGACY_COOKIE_TTL;
+    ngx_http_block_legacy_sign(bmcf, expires, addr, mac);
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    p = ngx_pnalloc(r->pool, sizeof(NGX_HTTP_BLOCK_LEGACY_COOKIE "=-")
+                             - 1 + NGX_TIME_T_LEN + 2 * 20
+                             + sizeof("; Max-Age=; Path=/; HttpOnly; Secure")
+                             - 1 + NGX_INT_T_LEN);
+    if (p == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    h->hash = 1;
+    ngx_str_set(&h->key, "Set-Cookie");
+    h->value.data = p;
+
+    p = ngx_sprintf(p, NGX_HTTP_BLOCK_LEGACY_COOKIE "=%T-", expires);
+    p = ngx_hex_dump(p, mac, 20);
+    p = ngx_sprintf(p, "; Max-Age=%d; Path=/; HttpOnly",
+                    NGX_HTTP_BLOCK_LEGACY_COOKIE_TTL);
+
+#if (NGX_HTTP_SSL)
+    if (r->connection->ssl) {
+        p = ngx_cpymem(p, "; Secure", sizeof("; Secure") - 1);
+    }
+#endif
+
+    h->value.len = p - h->value.data;
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    h->hash = 1;
+    ngx_str_set(&h->key, "Location");
+    h->value = r->unparsed_uri;
+
+    r->headers_out.location = h;
+    r->headers_out.status = NGX_HTTP_TEMPORARY_REDIRECT;
+    r->headers_out.content_length_n = 0;
+    r->header_only = 1;
+
+    return ngx_http_send_header(r);
+}
+
+static char *
+ngx_http_block_legacy_h2_memory(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_block_legacy_main_conf_t *bmcf = conf;
+    ngx_str_t *value, s;
+    ngx_http_compile_complex_value_t ccv;
+
+    if (bmcf->h2_memory != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    bmcf->h2_memory = ngx_parse_time(&value[1], 0);
+    if (bmcf->h2_memory == (ngx_msec_t) NGX_ERROR || bmcf->h2_memory == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid time \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts == 2) {
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[2].data, "fingerprint=", 12) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    s.data = value[2].data + 12;
+    s.len = value[2].len - 12;
+
+    bmcf->h2_fingerprint = ngx_palloc(cf->pool,
+                                      sizeof(ngx_http_complex_value_t));
+    if (bmcf->h2_fingerprint == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &s;
+    ccv.complex_value = bmcf->h2_fingerprint;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static uint32_t
+ngx_http_block_legacy_fingerprint(ngx_http_request_t *r,
+    ngx_http_block_legacy_main_conf_t *bmcf)
+{
+    ngx_str_t value;
+
+    if (bmcf->h2_fingerprint == NULL
+        || ngx_http_complex_value(r, bmcf->h2_fingerprint, &value) != NGX_OK)
+    {
+        return 0;
+    }
+
+    return ngx_murmur_hash2(value.data, value.len);
+}
+
+/*
+ * Records an HTTP/2+ request.  Updates are sampled through a per worker
+ * cache: a client is written to the zone at most once per quarter of
+ * block_legacy_h2_memory.
+ */
+
+static void
+ngx_http_block_legacy_remember(ngx_http_request_t *r)
+{
+    ngx_http_block_legacy_main_conf_t *bmcf;
+    ngx_http_block_legacy_ctx_t *ctx;
+    ngx_http_block_legacy_slot_t *slot;
+    ngx_http_block_legacy_seen_t *seen;
+    ngx_http_block_legacy_capable_t *cap;
+    uint32_t hash, fingerprint;
+    u_char key[16];
+
+    bmcf = ngx_http_get_module_main_conf(r, ngx_http_block_legacy_module);
+
+    if (bmcf->h2_memory == 0) {
+        return;
+    }
+
+    hash = ngx_http_block_legacy_key(r->connection->sockaddr, key);
+    if (hash == 0) {
+        return;
+    }
+
+    fingerprint = ngx_http_block_legacy_fingerprint(r, bmcf);
+
+    /* this worker's next HTTP/1.1 fallback need not look it up */
+
+    cap = &bmcf->capable[hash % NGX_HTTP_BLOCK_LEGACY_CAPABLE];
+
+    cap->hash = hash;
+    cap->fingerprint = fingerprint;
+    cap->expires = ngx_current_msec + bmcf->h2_memory;
+    cap->capable = 1;
+
+    seen = &bmcf->seen[hash % NGX_HTTP_BLOCK_LEGACY_SEEN];
+
+    if (seen->hash == hash
+        && seen->fingerprint == fingerprint
+        && ngx_current_msec - seen->written < bmcf->h2_memory / 4)
+    {
+        return;
+    }
+
+    ctx = bmcf->shm_zone->data;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    slot = ngx_http_block_legacy_lookup(ctx, key, hash, 1);
+    slot->flags |= NGX_HTTP_BLOCK_LEGACY_MODERN;
+    slot->modern = ngx_current_msec;
+    slot->fingerprint = fingerprint;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    seen->hash = hash;
+    seen->fingerprint = fingerprint;
+    seen->written = ngx_current_msec;
+}
+
+/*
+ * Answers from a per worker cache where possible: a hit is valid until the
+ * recorded HTTP/2 request is forgotten, a miss for a second.
+ */
+
+static ngx_uint_t
+ngx_http_block_legacy_h2_capable(ngx_http_request_t *r)
+{
+    ngx_http_block_legacy_main_conf_t *bmcf;
+    ngx_http_block_legacy_ctx_t *ctx;
+    ngx_http_block_legacy_slot_t *slot;
+    ngx_http_block_legacy_capable_t *cap;
+    ngx_msec_t expires;
+    ngx_uint_t capable;
+    uint32_t hash, fingerprint;
+    u_char key[16];
+
+    bmcf = ngx_http_get_module_main_conf(r, ngx_http_block_legacy_module);
+
+    hash = ngx_http_block_legacy_key(r->connection->sockaddr, key);
+    if (hash == 0) {
+        return 0;
+    }
+
+    fingerprint = ngx_http_block_legacy_fingerprint(r, bmcf);
+
+    cap = &bmcf->capable[hash % NGX_HTTP_BLOCK_LEGACY_CAPABLE];
+
+    if (cap->hash == hash
+        && cap->fingerprint == fingerprint
+        && (ngx_msec_int_t) (cap->expires - ngx_current_msec) > 0)
+    {
+        return cap->capable;
+    }
+
+    ctx = bmcf->shm_zone->data;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    slot = ngx_http_block_legacy_lookup(ctx, key, hash, 0);
+
+    capable = (slot != NULL
+               && (slot->flags & NGX_HTTP_BLOCK_LEGACY_MODERN)
+               && ngx_current_msec - slot->modern <= bmcf->h2_memory
+               && slot->fingerprint == fingerprint);
+
+    expires = capable ? slot->modern + bmcf->h2_memory
+                      : ngx_current_msec + NGX_HTTP_BLOCK_LEGACY_CAPABLE_MISS;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    cap->hash = hash;
+    cap->fingerprint = fingerprint;
+    cap->expires = expires;
+    cap->capable = capable;
+
+    return capable;
 }